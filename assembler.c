@@ -1,11 +1,13 @@
 /*
 Transpiles assembly like code to binary for BattelASM. Made by Gregorcnik.
 ===================================================================
-Compile normally (cc -o assembler assembler.c for instance). 
-The program outputs the transpiled c code to stdout and errors to stderr, so you can do 
+Compile normally (cc -o assembler assembler.c for instance).
+The program outputs the transpiled c code to stdout and errors to stderr, so you can do
 ./assembler example.asm > example.c
 For other options type ./assembler -help
 
+Compiled with -DBAS_NO_MAIN this file is the libbattelasm library instead (see battelasm.h).
+
 This project is licensed under the following terms:
 You are free to use, modify, and redistribute this software, provided that:
  - Credit is given to Gregorcnik as the original author.
@@ -13,9 +15,10 @@ You are free to use, modify, and redistribute this software, provided that:
 No warranty is provided. Use at your own risk.
 */
 
-#include <assert.h>
 #include <ctype.h>
 #include <errno.h>
+#include <limits.h>
+#include <stdarg.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -24,6 +27,17 @@ No warranty is provided. Use at your own risk.
 #include <strings.h>
 #include <time.h>
 
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#include "battelasm.h"
+
 #define inside(low, mid, high) ((low) <= (mid) && (mid) <= (high))
 typedef uint16_t fint;
 
@@ -32,541 +46,1157 @@ typedef uint16_t fint;
 #define strcasecmp _stricmp
 #endif
 
-#if defined(_WIN32) && !defined(HAVE_GETLINE)
-#include <BaseTsd.h> // for SSIZE_T on MSVC
-typedef SSIZE_T ssize_t;
+enum {
+	SP = 30,
+	PC = 31,
+};
 
-ssize_t getline(char **lineptr, size_t *n, FILE *stream) {
-	if (!lineptr || !n || !stream) {
-		errno = EINVAL;
-		return -1;
-	}
+// The instruction set, the only place it's described: name, opcode (the top 6 bits), the lowercase
+// mnemonic (zero padded to 4 characters) and both operands as kind (BAS_NONE, BAS_REG, BAS_IMM6 or
+// BAS_IMM16) and the bit their field starts at. The encoder, the arity checks and the decoder all
+// read the isa table generated from it. The 6 bit immediate of addi, subi, shli and shri starts at bit 0
+// and shares bit 5 with the register field, so an odd register adds 32 to it.
+#define OPERATIONS(X) \
+	X(LDI, 0x00, 'l', 'd', 'i', 0, IMM16, 0, NONE, 0)   \
+	X(MV, 0x20, 'm', 'v', 0, 0, REG, 5, REG, 0)         \
+	X(ADD, 0x21, 'a', 'd', 'd', 0, REG, 5, REG, 0)      \
+	X(SUB, 0x22, 's', 'u', 'b', 0, REG, 5, REG, 0)      \
+	X(NOT, 0x23, 'n', 'o', 't', 0, REG, 5, NONE, 0)     \
+	X(AND, 0x24, 'a', 'n', 'd', 0, REG, 5, REG, 0)      \
+	X(OR, 0x25, 'o', 'r', 0, 0, REG, 5, REG, 0)         \
+	X(XOR, 0x26, 'x', 'o', 'r', 0, REG, 5, REG, 0)      \
+	X(SHL, 0x27, 's', 'h', 'l', 0, REG, 5, REG, 0)      \
+	X(SHR, 0x28, 's', 'h', 'r', 0, REG, 5, REG, 0)      \
+	X(JMP, 0x29, 'j', 'm', 'p', 0, REG, 5, NONE, 0)     \
+	X(JZ, 0x2a, 'j', 'z', 0, 0, REG, 5, REG, 0)         \
+	X(JNZ, 0x2b, 'j', 'n', 'z', 0, REG, 5, REG, 0)      \
+	X(JN, 0x2c, 'j', 'n', 0, 0, REG, 5, REG, 0)         \
+	X(JP, 0x2d, 'j', 'p', 0, 0, REG, 5, REG, 0)         \
+	X(LD, 0x2e, 'l', 'd', 0, 0, REG, 5, REG, 0)         \
+	X(ST, 0x2f, 's', 't', 0, 0, REG, 5, REG, 0)         \
+	X(PUSH, 0x30, 'p', 'u', 's', 'h', REG, 5, NONE, 0)  \
+	X(POP, 0x31, 'p', 'o', 'p', 0, REG, 5, NONE, 0)     \
+	X(ADDI, 0x32, 'a', 'd', 'd', 'i', REG, 5, IMM6, 0)  \
+	X(SUBI, 0x33, 's', 'u', 'b', 'i', REG, 5, IMM6, 0)  \
+	X(SHLI, 0x34, 's', 'h', 'l', 'i', REG, 5, IMM6, 0)  \
+	X(SHRI, 0x35, 's', 'h', 'r', 'i', REG, 5, IMM6, 0)  \
+	X(FLAG, 0x3f, 'f', 'l', 'a', 'g', NONE, 0, NONE, 0)
 
-	if (*lineptr == NULL || *n == 0) {
-		*n = 128;
-		*lineptr = (char *)malloc(*n);
-		if (*lineptr == NULL) {
-			errno = ENOMEM;
-			return -1;
-		}
-	}
+enum {
+#define X(name, code, ...) OP_##name = code,
+	OPERATIONS(X)
+#undef X
+};
 
-	size_t pos = 0;
-	int c = 0;
+// Dense numbers of the operations in the order above (bas_instr.handler), for interpreter jump tables
+enum {
+#define X(name, ...) HANDLER_##name,
+	OPERATIONS(X)
+#undef X
+	HANDLERS
+};
+_Static_assert(HANDLERS == BAS_HANDLERS, "BAS_HANDLERS is out of date");
 
-	while ((c = fgetc(stream)) != EOF) {
-		if (pos + 1 >= *n) { // need room for c and '\0'
-			size_t new_size = (*n > SIZE_MAX / 2) ? SIZE_MAX : (*n * 2);
-			if (new_size <= *n) { // overflow or stuck
-				errno = EOVERFLOW;
-				return -1;
-			}
-			char *new_ptr = (char *)realloc(*lineptr, new_size);
-			if (new_ptr == NULL) {
-				errno = ENOMEM;
-				return -1;
-			}
-			*lineptr = new_ptr;
-			*n = new_size;
-		}
+typedef struct {
+	char mnemonic[5];
+	uint8_t len; // of the mnemonic
+	uint8_t arity;
+	uint8_t kind[2];
+	uint8_t shift[2];
+	fint used; // bits taken by the opcode and the operand fields
+	uint8_t handler;
+} Instr;
+
+// Operand field widths by kind
+#define BITS_NONE 0
+#define BITS_REG 5
+#define BITS_IMM6 6
+#define BITS_IMM16 16
+static const int operand_bits[] = {[BAS_NONE] = BITS_NONE, [BAS_REG] = BITS_REG, [BAS_IMM6] = BITS_IMM6, [BAS_IMM16] = BITS_IMM16};
+
+// Indexed by opcode; unused opcodes have an empty mnemonic
+static const Instr isa[64] = {
+#define X(name, code, a, b, c, d, k0, s0, k1, s1)                                                             \
+	[code] = {{a, b, c, d, 0}, 1 + !!(b) + !!(c) + !!(d), (BAS_##k0 != BAS_NONE) + (BAS_##k1 != BAS_NONE), \
+			  {BAS_##k0, BAS_##k1}, {s0, s1}, 0xFC00 | ((1u << BITS_##k0) - 1) << s0 | ((1u << BITS_##k1) - 1) << s1, HANDLER_##name},
+	OPERATIONS(X)
+#undef X
+};
 
-		(*lineptr)[pos++] = (char)c;
-		if (c == '\n')
-			break;
-	}
+// Packs up to 4 lowercase characters into one integer, so a mnemonic can be matched with a single switch
+#define MNEMONIC(a, b, c, d) ((uint32_t)(a) | (uint32_t)(b) << 8 | (uint32_t)(c) << 16 | (uint32_t)(d) << 24)
 
-	if (pos == 0 && c == EOF) {
-		return -1; // EOF with no data read
-	}
+// #size and #after depend on the final instruction count, so instructions using them
+// are emitted with a zero immediate and patched once the whole file has been read.
+typedef struct {
+	size_t instruction; // index of the instruction to patch
+	size_t linenum;
+	const char *token; // the constant as written in the source (not null terminated)
+	int token_len;
+	bool after; // #after instead of #size
+	int change, multiplier;
+	int bits; // width of the immediate (16 for ldi, 6 for the immediate forms); 0 if there's no fixup
+} Fixup;
+
+// A token is a span of the source line, so tokenizing needs no copies or allocations.
+// The first characters are also stored lowercase for the mnemonic lookup; variable names are hashed
+// and compared case-insensitively from the source bytes instead.
+#define TOKEN_FOLDED 16
+typedef struct {
+	const char *s; // not null terminated
+	int len;
+	char folded[TOKEN_FOLDED]; // lowercase copy of the first TOKEN_FOLDED - 1 characters (null terminated)
+} Token;
 
-	(*lineptr)[pos] = '\0';
-	return (ssize_t)pos;
-}
-#endif
+// The source is split into lines up front, so the assembler works on offsets into it and never
+// copies a line.
+typedef struct {
+	size_t start;
+	size_t code_end; // first ';' or end of the line, whichever comes first
+	size_t end; // the '\n' or the end of the input
+} Line;
 
-enum {
-	SP = 30,
-	PC = 31,
-};
+// Variables are interned by their case-folded name in an open addressing hash table. Interned names
+// are never removed (#free only unbinds the register), so lookups don't need tombstones.
+typedef struct {
+	uint32_t hash;
+	uint32_t name, len; // folded name in VariableTable.names; len == 0 marks an empty slot
+	uint32_t spelling; // the name as written when it was last bound (for -vartable), also len long
+	int reg; // bound register or -1
+} Variable;
 
-enum {
-	OP_LDI = 0x0,
-	OP_MV = 0x20,
-	OP_ADD,
-	OP_SUB,
-	OP_NOT,
-	OP_AND,
-	OP_OR,
-	OP_XOR,
-	OP_SHL,
-	OP_SHR,
-	OP_JMP,
-	OP_JZ,
-	OP_JNZ,
-	OP_JN,
-	OP_JP,
-	OP_LD,
-	OP_ST,
-	OP_PUSH,
-	OP_POP,
-	OP_ADDI,
-	OP_SUBI,
-	OP_SHLI,
-	OP_SHRI,
-	OP_FLAG = 0x3f
-};
+typedef struct {
+	Variable *slots;
+	size_t cap, count; // cap is a power of two
+	char *names;
+	size_t names_len, names_cap;
+	uint32_t used; // bitmask of registers bound to a name (r0 is never handed out)
+	Variable *bound[32];
+} VariableTable;
+
+// Incremental mode: the encoding of every line that doesn't use variables is remembered by its text,
+// so reassembling an edited program only encodes the lines that changed. Entries of deleted lines
+// stay until the table grows well past the size of the program and is emptied.
+typedef struct {
+	uint64_t hash; // 0 marks an empty slot
+	size_t text, len; // the line's code in LineMemoTable.text
+	int status; // compileLine() result
+	fint word;
+	size_t before; // instruction number the line was encoded at if it uses #before, else SIZE_MAX
+	Fixup fix;
+	size_t token; // fix.token as an offset from the start of the line
+} LineMemo;
 
 typedef struct {
-	bool comments, var_table, decimal_instr, vars;
-} Options;
+	LineMemo *slots;
+	size_t count, cap; // cap is a power of two
+	char *text;
+	size_t text_len, text_cap;
+} LineMemoTable;
+
+// Everything that only lives as long as one program (the line index, the image, fixups, the variable
+// table and the error list) is bump allocated from an arena, which is emptied in one go when the next
+// program starts. If a program needed more than one block, they're merged into one for the next, so
+// a batch of similar programs soon runs without calling malloc at all.
+typedef struct ArenaBlock {
+	struct ArenaBlock *next; // the older blocks
+	size_t cap, used;
+	max_align_t data[];
+} ArenaBlock;
+
+#define ARENA_BLOCK (64 << 10) // smallest block size
+#define ARENA_ALIGN _Alignof(max_align_t)
 
-static char ERROR_TEXT[256];
+typedef struct {
+	ArenaBlock *head; // allocations come from here
+	void *last; // the latest allocation, which can still grow in place
+	size_t total; // capacity of all the blocks
+} Arena;
+
+struct bas_ctx {
+	bool vars;
+	bool incremental;
+	uint32_t rng; // xorshift32 state for random offsets
+	// The last error; only formatted by bas_format_error
+	struct {
+		int code;
+		const char *s; // the token in the source, NULL if there's none
+		int len;
+		long long args[2];
+	} error;
+
+	Arena arena;
+	bas_stats stats;
+
+	// In the arena, all of them reset by resetArrays()
+	VariableTable variables;
+	Line *lines;
+	size_t lines_cap;
+	fint *code;
+	size_t code_cap;
+	bas_line *code_lines;
+	size_t code_lines_cap;
+	Fixup *fixups;
+	size_t fixups_cap;
+
+	bas_error *errors; // bas_check
+	size_t errors_len, errors_cap;
+
+	// Kept between programs, so not in the arena
+	LineMemoTable memo;
+	bool line_depends; // the line compileLine() just encoded named a variable, sp or pc, so it isn't memoized
+	bool line_before; // it used #before, so its memo only holds at the same instruction
+};
 
-int parseNum(char *s, int *ret);
-int parseConst(char *s, size_t program_size, size_t instruction_num, int *ret);
-void writeBin(FILE *fout, fint n);
-int getRegister(char *symbol, fint *ret, bool use_vars);
-int getOperation(char *symbol, fint *ret);
-int compileLine(char *line, size_t program_size, size_t instruction_num, fint *ret, bool use_vars);
-int compileFile(FILE *fin, Options *opts);
-void countInstructions(FILE *fin, size_t *ret);
+static int nextToken(const char **p, const char *end, Token *tok);
+static int parseNum(bas_ctx *ctx, const Token *tok, int *ret);
+static int parseConst(bas_ctx *ctx, const Token *tok, size_t instruction_num, int *ret, Fixup *fix);
+static int getRegister(bas_ctx *ctx, const Token *tok, fint *ret);
+static int getOperation(bas_ctx *ctx, const Token *tok, fint *ret);
+static int compileLine(bas_ctx *ctx, const char *line, const char *end, size_t instruction_num, fint *ret, Fixup *fix);
+static int indexLines(bas_ctx *ctx, const char *data, size_t len, size_t *count);
+static int reserve(void *arr, size_t *cap, size_t need, size_t size);
+static int arenaReserve(bas_ctx *ctx, void *arr, size_t *cap, size_t need, size_t size);
+static int setError(bas_ctx *ctx, int code, const char *s, int len, long long a, long long b);
+
+bas_ctx *bas_new(const bas_options *opts) {
+	bas_ctx *ctx = calloc(1, sizeof(*ctx));
+	if (!ctx)
+		return NULL;
+	ctx->vars = opts ? opts->vars : true;
+	ctx->incremental = opts ? opts->incremental : false;
+	ctx->rng = (opts ? opts->seed : 0) | 1; // xorshift state must not be zero
+	ctx->stats.mallocs = 1;
+	return ctx;
+}
 
-int main(int argc, char *argv[]) {
-	srand(time(0));
+void bas_free(bas_ctx *ctx) {
+	if (!ctx)
+		return;
+	for (ArenaBlock *b = ctx->arena.head, *next; b; b = next) {
+		next = b->next;
+		free(b);
+	}
+	free(ctx->memo.slots);
+	free(ctx->memo.text);
+	free(ctx);
+}
 
-	int argi = 1;
-	Options opts = {.comments = true, .var_table = false, .decimal_instr = false, .vars = true};
+static uint32_t hashName(const char *s, int len) {
+	uint32_t h = 2166136261u; // FNV-1a
+	for (int i = 0; i < len; i++)
+		h = (h ^ (unsigned char)(inside('A', s[i], 'Z') ? s[i] | 0x20 : s[i])) * 16777619u;
+	return h;
+}
 
-	for (; argi < argc; argi++) {
-		char *p = argv[argi];
-		if (p[0] != '-')
-			break;
-		if (strcmp(p, "-nocomments") == 0)
-			opts.comments = false;
-		else if (strcmp(p, "-vartable") == 0)
-			opts.var_table = true;
-		else if (strcmp(p, "-novars") == 0)
-			opts.vars = false;
-		else if (strcmp(p, "-decimal") == 0)
-			opts.decimal_instr = true;
-		else if (strcmp(p, "-obfuscate") == 0) {
-			opts.comments = false;
-			opts.decimal_instr = true;
-		} else if (strcmp(p, "-help") == 0)
-			goto usage;
-		else {
-			fprintf(stderr, "Unknown parameter '%s'\n", p);
-			goto usage;
-		}
+// Returns the slot holding the name or the empty slot where it belongs
+static Variable *findVariable(VariableTable *t, const char *s, int len, uint32_t hash) {
+	size_t mask = t->cap - 1;
+	for (size_t i = hash & mask;; i = (i + 1) & mask) {
+		Variable *v = &t->slots[i];
+		if (v->len == 0 || (v->hash == hash && v->len == (uint32_t)len && strncasecmp(t->names + v->name, s, len) == 0))
+			return v;
 	}
+}
 
-	if (!opts.vars && opts.var_table) {
-		fprintf(stderr, "-novars and -vartable aren't compatible.\n");
-		goto usage;
+static int growVariables(bas_ctx *ctx, VariableTable *t) {
+	Variable *old = t->slots;
+	size_t old_cap = t->cap;
+	t->cap = old_cap ? old_cap * 2 : 64;
+	t->slots = NULL;
+	size_t cap = 0;
+	if (!arenaReserve(ctx, &t->slots, &cap, t->cap, sizeof(Variable))) {
+		t->slots = old;
+		t->cap = old_cap;
+		return 0;
 	}
-
-	if (argi >= argc) {
-		fprintf(stderr, "Input file not specified.\n");
-		goto usage;
+	memset(t->slots, 0, t->cap * sizeof(Variable));
+
+	for (size_t i = 0; i < old_cap; i++) {
+		if (old[i].len == 0)
+			continue;
+		Variable *v = findVariable(t, t->names + old[i].name, old[i].len, old[i].hash);
+		*v = old[i];
+		if (v->reg != -1)
+			t->bound[v->reg] = v;
 	}
-	if (argi < argc - 1) {
-		fprintf(stderr, "Parameters after input file (%s) are prohibited\n", argv[argi]);
-		goto usage;
+	return 1;
+}
+
+// Copies the name (folded and as written) into the table and binds it to reg
+static int bindVariable(bas_ctx *ctx, VariableTable *t, Variable *v, const char *s, int len, uint32_t hash, int reg) {
+	if (!arenaReserve(ctx, &t->names, &t->names_cap, t->names_len + 2 * len, 1))
+		return 0;
+
+	if (v->len == 0) {
+		v->hash = hash;
+		v->len = len;
+		v->name = t->names_len;
+		for (int i = 0; i < len; i++)
+			t->names[t->names_len++] = inside('A', s[i], 'Z') ? s[i] | 0x20 : s[i];
+		t->count++;
 	}
+	v->spelling = t->names_len;
+	memcpy(t->names + t->names_len, s, len);
+	t->names_len += len;
 
-	FILE *fin = fopen(argv[argi], "r");
-	if (!fin) {
-		perror("fopen");
+	v->reg = reg;
+	t->used |= 1u << reg;
+	t->bound[reg] = v;
+	return 1;
+}
+
+// Returns the register bound to the name or -1
+static int lookupVariable(VariableTable *t, const char *s, int len) {
+	Variable *v = findVariable(t, s, len, hashName(s, len));
+	return v->len ? v->reg : -1;
+}
+
+// Binds the name to reg. Returns 0 if out of memory.
+static int addVariableAt(bas_ctx *ctx, VariableTable *t, const char *s, int len, int reg) {
+	if ((t->count + 1) * 2 > t->cap && !growVariables(ctx, t))
+		return 0;
+	uint32_t hash = hashName(s, len);
+	return bindVariable(ctx, t, findVariable(t, s, len, hash), s, len, hash, reg);
+}
+
+// Binds the name to the lowest free register. Returns the register, -1 if all of them are taken
+// or -2 if out of memory.
+static int addVariable(bas_ctx *ctx, VariableTable *t, const char *s, int len) {
+	uint32_t free_regs = ~t->used;
+	if (!free_regs)
+		return -1;
+#if defined(__GNUC__) || defined(__clang__)
+	int reg = __builtin_ctz(free_regs);
+#else
+	int reg = 0;
+	while (!(free_regs & 1u << reg))
+		reg++;
+#endif
+	return addVariableAt(ctx, t, s, len, reg) ? reg : -2;
+}
+
+// Unbinds the register of a variable (r1-r29 only). Returns 0 if the name isn't bound.
+static int freeVariable(VariableTable *t, const char *s, int len) {
+	Variable *v = findVariable(t, s, len, hashName(s, len));
+	if (v->len == 0 || !inside(1, v->reg, 29))
+		return 0;
+	t->used &= ~(1u << v->reg);
+	t->bound[v->reg] = NULL;
+	v->reg = -1;
+	return 1;
+}
+
+// Starts an empty table (after resetArrays()) and binds sp and pc
+static int resetVariables(bas_ctx *ctx, VariableTable *t) {
+	memset(t, 0, sizeof(*t));
+	t->used = 1u; // r0 is never used for variables
+	return addVariableAt(ctx, t, "sp", 2, SP) && addVariableAt(ctx, t, "pc", 2, PC);
+}
+
+size_t bas_variable(const bas_ctx *ctx, int reg, const char **name) {
+	if (!inside(0, reg, 31) || !ctx->variables.bound[reg])
+		return 0;
+	*name = ctx->variables.names + ctx->variables.bound[reg]->spelling;
+	return ctx->variables.bound[reg]->len;
+}
+
+// Makes room for at least `need` elements of size `size` in *arr
+static int reserve(void *arr, size_t *cap, size_t need, size_t size) {
+	if (need <= *cap)
 		return 1;
+	size_t new_cap = *cap ? *cap : 64;
+	while (new_cap < need)
+		new_cap *= 2;
+	void *tmp = realloc(*(void **)arr, new_cap * size);
+	if (!tmp)
+		return 0;
+	*(void **)arr = tmp;
+	*cap = new_cap;
+	return 1;
+}
+
+// Takes size bytes from the arena, starting a new block if the current one is full
+static void *arenaAlloc(bas_ctx *ctx, size_t size) {
+	Arena *a = &ctx->arena;
+	size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+	ArenaBlock *b = a->head;
+	if (!b || b->cap - b->used < size) {
+		size_t cap = ARENA_BLOCK;
+		while (cap < size || cap < a->total) // so the number of blocks stays logarithmic
+			cap *= 2;
+		if (!(b = malloc(sizeof(*b) + cap)))
+			return NULL;
+		*b = (ArenaBlock){.next = a->head, .cap = cap};
+		a->head = b;
+		a->total += cap;
+		ctx->stats.mallocs++;
 	}
+	a->last = (unsigned char *)b->data + b->used;
+	b->used += size;
+	ctx->stats.allocs++;
+	return a->last;
+}
 
-	int rc = compileFile(fin, &opts);
-	fclose(fin);
-	return rc != 1;
+// reserve() for arrays in the arena. The latest allocation grows in place while its block has room,
+// anything else is copied to a new allocation (the old one is only reclaimed by the next reset).
+static int arenaReserve(bas_ctx *ctx, void *arr, size_t *cap, size_t need, size_t size) {
+	if (need <= *cap)
+		return 1;
+	size_t new_cap = *cap ? *cap : 64;
+	while (new_cap < need)
+		new_cap *= 2;
+
+	Arena *a = &ctx->arena;
+	void *old = *(void **)arr;
+	if (old && old == a->last) {
+		size_t start = (size_t)((unsigned char *)old - (unsigned char *)a->head->data);
+		size_t bytes = (new_cap * size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+		if (bytes <= a->head->cap - start) {
+			a->head->used = start + bytes;
+			*cap = new_cap;
+			return 1;
+		}
+	}
 
-usage:
-	fprintf(stderr, "Usage: %s -help -nocomments [-vartable -novars] -decimal -obfuscate <input.asm>\n", argv[0]);
+	void *tmp = arenaAlloc(ctx, new_cap * size);
+	if (!tmp)
+		return 0;
+	if (old)
+		memcpy(tmp, old, *cap * size);
+	*(void **)arr = tmp;
+	*cap = new_cap;
 	return 1;
 }
 
-char variables[32][255];
+// Empties the arena for the next program. If the last one needed several blocks, they're replaced by
+// a single block as big as all of them.
+static void resetArena(bas_ctx *ctx) {
+	Arena *a = &ctx->arena;
+	if (a->head && a->head->next) {
+		for (ArenaBlock *b = a->head, *next; b; b = next) {
+			next = b->next;
+			free(b);
+			ctx->stats.frees++;
+		}
+		a->head = malloc(sizeof(*a->head) + a->total);
+		if (a->head) {
+			*a->head = (ArenaBlock){.cap = a->total};
+			ctx->stats.mallocs++;
+		} else
+			a->total = 0; // arenaAlloc() will try again with smaller blocks
+	}
+	if (a->head)
+		a->head->used = 0;
+	a->last = NULL;
+}
 
-void init_variables() {
-	strcpy(variables[30], "sp");
-	strcpy(variables[31], "pc");
+// Starts a program: every array in the arena is empty again
+static void resetArrays(bas_ctx *ctx) {
+	resetArena(ctx);
+	ctx->lines = NULL;
+	ctx->code = NULL;
+	ctx->code_lines = NULL;
+	ctx->fixups = NULL;
+	ctx->errors = NULL;
+	ctx->lines_cap = ctx->code_cap = ctx->code_lines_cap = ctx->fixups_cap = ctx->errors_cap = 0;
+	ctx->errors_len = 0;
+	ctx->stats.programs++;
 }
 
-void countInstructions(FILE *fin, size_t *ret) {
-	*ret = -1; // because of the first line
+void bas_get_stats(const bas_ctx *ctx, bas_stats *stats) {
+	*stats = ctx->stats;
+	stats->bytes = ctx->arena.total;
+}
 
-	char *line = NULL;
-	size_t cap = 0;
-	ssize_t len;
+static int addLine(bas_ctx *ctx, size_t *count, size_t start, size_t code_end, size_t end) {
+	if (!arenaReserve(ctx, &ctx->lines, &ctx->lines_cap, *count + 1, sizeof(*ctx->lines)))
+		return 0;
+	ctx->lines[(*count)++] = (Line){.start = start, .code_end = code_end, .end = end};
+	return 1;
+}
 
-	while ((len = getline(&line, &cap, fin)) > 0) {
-		if (line[0] == '#') {
-			if (strncasecmp(line, "#starts", 7) == 0) {
-				int param;
-				sscanf(line, "%*s %d", &param);
-				*ret = param;
+// Finds every '\n' and the first ';' of each line in one pass over the source, 32 (AVX2) or
+// 16 (SSE2) bytes at a time.
+static int indexLines(bas_ctx *ctx, const char *data, size_t len, size_t *count) {
+	*count = 0;
+
+	size_t start = 0, code_end = SIZE_MAX, i = 0;
+
+#if defined(__AVX2__)
+	const __m256i nl = _mm256_set1_epi8('\n'), semi = _mm256_set1_epi8(';');
+	for (; i + 32 <= len; i += 32) {
+		__m256i chunk = _mm256_loadu_si256((const __m256i *)(data + i));
+		uint32_t nl_mask = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, nl));
+		uint32_t mask = nl_mask | (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, semi));
+#elif defined(__SSE2__)
+	const __m128i nl = _mm_set1_epi8('\n'), semi = _mm_set1_epi8(';');
+	for (; i + 16 <= len; i += 16) {
+		__m128i chunk = _mm_loadu_si128((const __m128i *)(data + i));
+		uint32_t nl_mask = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, nl));
+		uint32_t mask = nl_mask | (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, semi));
+#endif
+#if defined(__AVX2__) || defined(__SSE2__)
+		while (mask) {
+			int bit = __builtin_ctz(mask);
+			size_t pos = i + bit;
+			if (nl_mask & (1u << bit)) {
+				if (!addLine(ctx, count, start, code_end == SIZE_MAX ? pos : code_end, pos))
+					return 0;
+				start = pos + 1;
+				code_end = SIZE_MAX;
+			} else if (code_end == SIZE_MAX) {
+				code_end = pos;
 			}
-		} else {
-			size_t i = 0;
-			for (; i < len && isspace((unsigned char)line[i]); i++)
-				;
-			if (i < len && line[i] != ';')
-				(*ret)++;
+			mask &= mask - 1;
+		}
+	}
+#endif
+
+	for (; i < len; i++) {
+		if (data[i] == '\n') {
+			if (!addLine(ctx, count, start, code_end == SIZE_MAX ? i : code_end, i))
+				return 0;
+			start = i + 1;
+			code_end = SIZE_MAX;
+		} else if (data[i] == ';' && code_end == SIZE_MAX) {
+			code_end = i;
 		}
 	}
+	if (start < len && !addLine(ctx, count, start, code_end == SIZE_MAX ? len : code_end, len))
+		return 0;
 
-	free(line);
+	return 1;
 }
 
-int compileFile(FILE *fin, Options *opts) {
-	if (!fin)
-		return 0;
+// Lines are short, so they're hashed 8 bytes at a time
+static uint64_t hashLine(const char *s, size_t len) {
+	uint64_t h = len * 0x9e3779b97f4a7c15ull;
+	for (; len >= 8; s += 8, len -= 8) {
+		uint64_t w;
+		memcpy(&w, s, 8);
+		h = (h ^ w) * 0xbf58476d1ce4e5b9ull;
+		h ^= h >> 29;
+	}
+	uint64_t w = 0;
+	memcpy(&w, s, len);
+	h = (h ^ w) * 0x94d049bb133111ebull;
+	return (h ^ h >> 31) | 1; // 0 marks empty slots
+}
 
-	init_variables();
+static LineMemo *findLineMemo(LineMemoTable *t, const char *s, size_t len, uint64_t hash) {
+	if (!t->cap)
+		return NULL;
+	size_t mask = t->cap - 1;
+	for (size_t i = hash & mask;; i = (i + 1) & mask) {
+		LineMemo *m = &t->slots[i];
+		if (m->hash == 0 || (m->hash == hash && m->len == len && memcmp(t->text + m->text, s, len) == 0))
+			return m;
+	}
+}
 
-	char *line = NULL;
-	size_t cap = 0;
-	size_t linenum = 1;
-	size_t instruction_num = 0;
-	ssize_t line_length;
+// Empties the table and makes room for lines entries
+static int resetLineMemo(LineMemoTable *t, size_t lines, bas_stats *stats) {
+	size_t cap = 64;
+	while (cap < 2 * lines)
+		cap *= 2;
+	if (cap > t->cap) {
+		free(t->slots);
+		stats->frees += t->slots != NULL;
+		t->cap = 0;
+		if (!(t->slots = malloc(cap * sizeof(*t->slots))))
+			return 0;
+		t->cap = cap;
+		stats->mallocs++;
+	}
+	memset(t->slots, 0, t->cap * sizeof(*t->slots));
+	t->count = t->text_len = 0;
+	return 1;
+}
 
-	size_t program_size;
-	countInstructions(fin, &program_size);
-	errno = 0;
-	rewind(fin);
-	if (errno != 0) {
-		perror("rewind");
-		return 0;
+// The table must have room (see bas_assemble)
+static int addLineMemo(LineMemoTable *t, const char *s, size_t len, uint64_t hash, const LineMemo *value, bas_stats *stats) {
+	LineMemo *m = findLineMemo(t, s, len, hash);
+	if (m->hash) { // a #before line that moved
+		size_t text = m->text;
+		*m = *value;
+		m->hash = hash;
+		m->text = text;
+		m->len = len;
+		return 1;
 	}
+	size_t text_cap = t->text_cap;
+	if (!reserve(&t->text, &t->text_cap, t->text_len + len + 1, 1)) // +1 so text is never NULL
+		return 0;
+	stats->mallocs += t->text_cap != text_cap; // a realloc
+	*m = *value;
+	m->hash = hash;
+	m->text = t->text_len;
+	m->len = len;
+	memcpy(t->text + t->text_len, s, len);
+	t->text_len += len;
+	t->count++;
+	return 1;
+}
 
-	int ok = 1;
+// Appends an instruction (line is NULL for #starts padding)
+static int emit(bas_ctx *ctx, size_t instruction_num, fint word, const Line *line, size_t linenum) {
+	if (!arenaReserve(ctx, &ctx->code, &ctx->code_cap, instruction_num + 1, sizeof(*ctx->code)) ||
+		!arenaReserve(ctx, &ctx->code_lines, &ctx->code_lines_cap, instruction_num + 1, sizeof(*ctx->code_lines)))
+		return 0;
+	ctx->code[instruction_num] = word;
+	ctx->code_lines[instruction_num] = line ? (bas_line){.line = linenum, .start = line->start, .len = line->end - line->start} : (bas_line){0};
+	return 1;
+}
 
-	char name[255];
-	int offset;
-	if (fscanf(fin, "%s %d ", name, &offset) == 2) {
-		printf("static uint16_t %s_mem[] = {\n", name);
-	} else {
-		fprintf(stderr, "Header line is missing (first line in the file must be 'name offset'. eg. example 10)\n");
+// Errors can't be formatted without the arguments, so they're only stored as codes
+static int setError(bas_ctx *ctx, int code, const char *s, int len, long long a, long long b) {
+	ctx->error.code = code;
+	ctx->error.s = s;
+	ctx->error.len = len;
+	ctx->error.args[0] = a;
+	ctx->error.args[1] = b;
+	return 0;
+}
+
+static bas_error takeError(const bas_ctx *ctx, const char *src, size_t linenum) {
+	return (bas_error){
+		.code = ctx->error.code,
+		.line = linenum,
+		.start = ctx->error.s ? (size_t)(ctx->error.s - src) : 0,
+		.len = ctx->error.s ? ctx->error.len : 0,
+		.args = {ctx->error.args[0], ctx->error.args[1]},
+	};
+}
+
+// Records the last error for bas_check
+static int addError(bas_ctx *ctx, const char *src, size_t linenum) {
+	if (!arenaReserve(ctx, &ctx->errors, &ctx->errors_cap, ctx->errors_len + 1, sizeof(*ctx->errors)))
 		return 0;
-	}
+	ctx->errors[ctx->errors_len++] = takeError(ctx, src, linenum);
+	return 1;
+}
 
-	if (offset == -1) {
-		offset = rand() % ((1 << 10) - program_size);
+// With check, no image is built and errors on lines are recorded with addError() instead of ending
+// the assembly. A failed instruction still counts as one, so #before and #size stay as they would be.
+static int assemble(bas_ctx *ctx, const char *src, size_t len, uint16_t *out, size_t cap, bas_result *res, bool check) {
+	memset(res, 0, sizeof(*res));
+	ctx->error.code = BAS_E_NONE;
+	resetArrays(ctx);
+
+	size_t linenum = 0; // line of the error
+	size_t instruction_num = 0;
+	size_t fixups_len = 0;
+	size_t lines_count;
+
+	if (!resetVariables(ctx, &ctx->variables) || !indexLines(ctx, src, len, &lines_count))
+		goto out_of_memory;
+	const Line *lines = ctx->lines;
+
+	LineMemoTable *memo = &ctx->memo;
+	if (ctx->incremental && (memo->count + lines_count > memo->cap / 2 || memo->text_len > 2 * len))
+		if (!resetLineMemo(memo, lines_count, &ctx->stats))
+			goto out_of_memory;
+
+	// The header is read in place like any other line: name and offset
+	Token name, offset;
+	const char *header = src, *header_end = src + (lines_count ? lines[0].code_end : 0);
+	if (!nextToken(&header, header_end, &name) || name.len >= (int)sizeof(res->name) ||
+		!nextToken(&header, header_end, &offset) || !parseNum(ctx, &offset, &res->offset)) {
+		setError(ctx, BAS_E_NO_HEADER, NULL, 0, 0, 0);
+		goto fail;
 	}
+	memcpy(res->name, name.s, name.len);
+	res->name[name.len] = '\0';
 
-	while ((line_length = getline(&line, &cap, fin)) != -1) {			
-		linenum++;
-		
-		// Add newline of not there
-		{
-			if (line[line_length - 1] != '\n') {
-				if (cap <= (size_t)line_length + 1) {
-					cap = (size_t)line_length + 2;
-					char *tmp = realloc(line, cap);
-					if (!tmp) {
-						perror("realloc");
-						ok = false;
-						goto cleanup;
-					}
-					line = tmp;
-				}
-				line[line_length] = '\n';
-				line[line_length + 1] = '\0';
-			}
-		}
+	for (size_t li = 1; li < lines_count; li++) {
+		const Line *ln = &lines[li];
+		const char *line = src + ln->start, *line_end = src + ln->code_end;
+		linenum = li + 1;
 
-		if (line[0] == '#') { // A directive
+		if (line < line_end && line[0] == '#') { // A directive
 
-			if (strncasecmp(line, "#starts", 7) == 0) {
+			if (line_end - line >= 7 && strncasecmp(line, "#starts", 7) == 0) {
+				const char *p = line;
+				Token tok;
 				int param;
-				sscanf(line, "%*s %d", &param);
-				if (param < instruction_num) {
-					fprintf(stderr, "Error on line %zu: #starts directive wants to go back (current instruction: %zu, wanted instruction: %d)\n", linenum, instruction_num, param);
-					ok = 0;
-					goto cleanup;
-				}
-				for (; instruction_num < param; instruction_num++) {
-					putchar('\t');
-					if (opts->decimal_instr)
-						printf("%d", 0b1111110000000000);
-					else
-						writeBin(stdout, 0b1111110000000000);
-					printf(",\n");
+				nextToken(&p, line_end, &tok); // the directive itself
+				if (!nextToken(&p, line_end, &tok)) {
+					setError(ctx, BAS_E_STARTS_PARAM, NULL, 0, 0, 0);
+					goto line_error;
 				}
-			} else if (strncasecmp(line, "#free", 5) == 0) {
-				char param[255];
-				sscanf(line, "%*s %254s", param);
-				int i;
-				for (i = 1; i < 30; i++) {
-					if (strcmp(variables[i], param) == 0) {
-						variables[i][0] = '\0';
-						break;
-					}
+				if (!parseNum(ctx, &tok, &param))
+					goto line_error;
+				if (param < 0 || (size_t)param < instruction_num) {
+					setError(ctx, BAS_E_STARTS_BACK, NULL, 0, instruction_num, param);
+					goto line_error;
 				}
-				if (i == 30) {
-					fprintf(stderr, "Error on line %zu: trying to free the variable %s which isn't in use\n", linenum, param);
-					ok = 0;
-					goto cleanup;
+				for (; instruction_num < (size_t)param; instruction_num++)
+					if (!check && !emit(ctx, instruction_num, 0b1111110000000000, NULL, 0))
+						goto out_of_memory;
+			} else if (line_end - line >= 5 && strncasecmp(line, "#free", 5) == 0) {
+				const char *p = line;
+				Token param;
+				nextToken(&p, line_end, &param); // the directive itself
+				if (!nextToken(&p, line_end, &param))
+					param.len = 0;
+				if (!freeVariable(&ctx->variables, param.s, param.len)) {
+					setError(ctx, BAS_E_FREE_UNUSED, param.s, param.len, 0, 0);
+					goto line_error;
 				}
 			}
 
 		} else { // An instruction
 
 			fint l;
-			int status = compileLine(line, program_size, instruction_num, &l, opts->vars);
+			Fixup fix;
+			int status;
+			LineMemo *m = NULL;
+			uint64_t hash = 0;
+			if (ctx->incremental) {
+				hash = hashLine(line, line_end - line);
+				m = findLineMemo(memo, line, line_end - line, hash);
+				if (m && (!m->hash || (m->before != SIZE_MAX && m->before != instruction_num)))
+					m = NULL;
+			}
+
+			if (m) {
+				status = m->status;
+				l = m->word;
+				fix = m->fix;
+				fix.token = line + m->token;
+				res->reused += status == 1;
+			} else {
+				ctx->line_depends = ctx->line_before = false;
+				status = compileLine(ctx, line, line_end, instruction_num, &l, &fix);
+				if (ctx->incremental && status && !ctx->line_depends) {
+					LineMemo value = {.status = status, .word = l, .before = ctx->line_before ? instruction_num : SIZE_MAX, .fix = fix};
+					value.token = fix.bits ? (size_t)(fix.token - line) : 0;
+					if (!addLineMemo(memo, line, line_end - line, hash, &value, &ctx->stats))
+						goto out_of_memory;
+				}
+			}
+
 			if (!status) {
-				fprintf(stderr, "Error on line %zu: %s\n", linenum, ERROR_TEXT);
-				ok = 0;
-				goto cleanup;
+				instruction_num += check;
+				goto line_error;
 			} else if (status == 1) {
-				putchar('\t');
-				if (opts->decimal_instr)
-					printf("%d", l);
-				else
-					writeBin(stdout, l);
-				if (opts->comments)
-					printf(", // %s", line);
-				else
-					printf(",\n");
-
+				if (fix.bits) {
+					if (!arenaReserve(ctx, &ctx->fixups, &ctx->fixups_cap, fixups_len + 1, sizeof(*ctx->fixups)))
+						goto out_of_memory;
+					fix.instruction = instruction_num;
+					fix.linenum = linenum;
+					ctx->fixups[fixups_len++] = fix;
+				}
+				if (!check && !emit(ctx, instruction_num, l, ln, linenum))
+					goto out_of_memory;
 				instruction_num++;
 			}
 
 		}
+		continue;
+
+	line_error:
+		if (!check)
+			goto fail;
+		if (!addError(ctx, src, linenum))
+			goto out_of_memory;
 	}
 
-	assert(program_size == instruction_num); // if false, instruction counting function probably doesn't work
+	size_t program_size = instruction_num;
+
+	for (size_t i = 0; i < fixups_len; i++) {
+		Fixup *f = &ctx->fixups[i];
+		int val = (f->after ? (int)(program_size - f->instruction - 1) : (int)program_size) * f->multiplier + f->change;
+		if (val < 0 || val >= (1 << f->bits)) {
+			linenum = f->linenum;
+			setError(ctx, BAS_E_RANGE, f->token, f->token_len, f->bits, val);
+			if (!check)
+				goto fail;
+			if (!addError(ctx, src, linenum))
+				goto out_of_memory;
+		} else if (!check)
+			ctx->code[f->instruction] |= (fint)val;
+	}
 
-	printf("};\n"
-		   "static uint16_t %s_size = %zu;\n"
-		   "static uint16_t %s_offset = %d;\n",
-		   name, program_size, name, offset);
+	if (check) {
+		if (res->offset == -1 && program_size >= (1 << 10)) {
+			setError(ctx, BAS_E_RANDOM_OFFSET, NULL, 0, program_size, 0);
+			if (!addError(ctx, src, 1))
+				goto out_of_memory;
+		}
+		res->size = program_size;
+		return ctx->errors_len == 0;
+	}
 
-	if (opts->var_table) {
-		putchar('\n');
-		for (int i = 1; i < 30; i++)
-			if (variables[i][0] != '\0')
-				printf("// %s: r%d\n", variables[i], i);
+	if (res->offset == -1) {
+		res->random_offset = true;
+		if (program_size >= (1 << 10)) {
+			linenum = 1;
+			setError(ctx, BAS_E_RANDOM_OFFSET, NULL, 0, program_size, 0);
+			goto fail;
+		}
+		ctx->rng ^= ctx->rng << 13;
+		ctx->rng ^= ctx->rng >> 17;
+		ctx->rng ^= ctx->rng << 5;
+		res->offset = ctx->rng % ((1 << 10) - program_size);
 	}
 
-cleanup:
-	if (line)
-		free(line);
-	return ok;
+	if (out) {
+		if (cap < program_size) {
+			linenum = 0;
+			setError(ctx, BAS_E_OUTPUT_SIZE, NULL, 0, program_size, cap);
+			goto fail;
+		}
+		memcpy(out, ctx->code, program_size * sizeof(*out));
+	}
+
+	res->size = program_size;
+	res->code = ctx->code;
+	res->lines = ctx->code_lines;
+	return 1;
+
+out_of_memory:
+	setError(ctx, BAS_E_OUT_OF_MEMORY, NULL, 0, 0, 0);
+fail:
+	res->error = takeError(ctx, src, linenum);
+	if (check)
+		addError(ctx, src, linenum); // may fail if out of memory, then the list is one short
+	return 0;
 }
 
-// Returns 2 on empty lines
-int compileLine(char *line, size_t program_size, size_t instruction_num, fint *ret, bool use_vars) {
-	*ret = 0;
+int bas_assemble(bas_ctx *ctx, const char *src, size_t len, uint16_t *out, size_t cap, bas_result *res) {
+	return assemble(ctx, src, len, out, cap, res, false);
+}
 
-	char *lline = strdup(line);
-	if (!lline) {
-		snprintf(ERROR_TEXT, 255, "Out of memory");
-		return 0;
+size_t bas_check(bas_ctx *ctx, const char *src, size_t len, const bas_error **errors) {
+	bas_result res;
+	if (!assemble(ctx, src, len, NULL, 0, &res, true) && ctx->errors_len == 0) { // out of memory for the list
+		static const bas_error oom = {.code = BAS_E_OUT_OF_MEMORY};
+		*errors = &oom;
+		return 1;
 	}
+	// Errors are found line by line, but those of #size and #after fixups and the random offset come
+	// last. An insertion sort puts them in place, keeps the order of ties and is quick on a list that's
+	// almost sorted.
+	for (size_t i = 1; i < ctx->errors_len; i++) {
+		bas_error e = ctx->errors[i];
+		size_t j = i;
+		for (; j > 0 && (ctx->errors[j - 1].line > e.line || (ctx->errors[j - 1].line == e.line && ctx->errors[j - 1].start > e.start)); j--)
+			ctx->errors[j] = ctx->errors[j - 1];
+		ctx->errors[j] = e;
+	}
+	*errors = ctx->errors;
+	return ctx->errors_len;
+}
 
-	const char *delims = " ,\t\r\n";
-	char *token = strtok(lline, delims);
-	if (!token || token[0] == ';') {
-		free(lline);
-		return 2;
+int bas_format_error(const bas_error *err, const char *src, char *buf, size_t cap) {
+	int len = (int)err->len;
+	const char *s = src + err->start;
+	long long a = err->args[0], b = err->args[1];
+	switch (err->code) {
+		case BAS_E_NONE:
+			return snprintf(buf, cap, "No error");
+		case BAS_E_NO_HEADER:
+			return snprintf(buf, cap, "Header line is missing (first line in the file must be 'name offset'. eg. example 10)");
+		case BAS_E_STARTS_PARAM:
+			return snprintf(buf, cap, "#starts directive needs a parameter");
+		case BAS_E_STARTS_BACK:
+			return snprintf(buf, cap, "#starts directive wants to go back (current instruction: %lld, wanted instruction: %lld)", a, b);
+		case BAS_E_FREE_UNUSED:
+			return snprintf(buf, cap, "trying to free the variable %.*s which isn't in use", len, s);
+		case BAS_E_RANGE:
+			return snprintf(buf, cap, "Number not in range [0, 2^%lld): '%.*s' -> %lld", a, len, s, b);
+		case BAS_E_RANDOM_OFFSET:
+			return snprintf(buf, cap, "Program is too big for a random offset (%lld instructions)", a);
+		case BAS_E_OUTPUT_SIZE:
+			return snprintf(buf, cap, "Output buffer too small (%lld instructions, room for %lld)", a, b);
+		case BAS_E_OUT_OF_MEMORY:
+			return snprintf(buf, cap, "Out of memory");
+		case BAS_E_TOO_MANY_PARAMS:
+			return snprintf(buf, cap, "Too many parameters (%lld expected)", a);
+		case BAS_E_TOO_FEW_PARAMS:
+			return snprintf(buf, cap, "Too few parameters (%lld expected)", a);
+		case BAS_E_UNKNOWN_INSTRUCTION:
+			return snprintf(buf, cap, "Unknown instruction: '%.*s'", len, s);
+		case BAS_E_UNKNOWN_REGISTER:
+			return snprintf(buf, cap, "Unknown register: '%.*s'", len, s);
+		case BAS_E_VARIABLE_NAME:
+			return snprintf(buf, cap, "Invalid variable name (starts with a digit or #): '%.*s'", len, s);
+		case BAS_E_VARIABLES_OFF:
+			return snprintf(buf, cap, "Invalid register (you have variables turned off): '%.*s'", len, s);
+		case BAS_E_TOO_MANY_VARIABLES:
+			return snprintf(buf, cap, "Too many variables (maybe #free some?): '%.*s'", len, s);
+		case BAS_E_UNKNOWN_CONSTANT:
+			return snprintf(buf, cap, "Unknown compile-time constant '%.*s'", len < 200 ? len : 200, s);
+		case BAS_E_BINARY:
+			return snprintf(buf, cap, "Invalid binary number: %.*s", len, s);
+		case BAS_E_HEX:
+			return snprintf(buf, cap, "Invalid hexadecimal number: %.*s", len, s);
+		case BAS_E_DECIMAL:
+			return snprintf(buf, cap, "Invalid decimal number: %.*s", len, s);
 	}
+	return snprintf(buf, cap, "Unknown error %d", err->code);
+}
 
-	fint opcode;
-	if (!getOperation(token, &opcode)) {
-		free(lline);
+// Advances *p past the next token before end. Commas are whitespace; comments are already cut off
+// by the line index. Returns 0 when the line has no more tokens.
+static int nextToken(const char **p, const char *end, Token *tok) {
+	const char *c = *p;
+	while (c < end && (*c == ' ' || *c == ',' || *c == '\t' || *c == '\r'))
+		c++;
+	if (c == end) {
+		*p = c;
 		return 0;
 	}
 
-	// Encode opcode in the top 6 bits
-	*ret = (opcode & 0x3F) << 10;
+	tok->s = c;
+	int i = 0;
+	for (; c < end && *c != ' ' && *c != ',' && *c != '\t' && *c != '\r'; c++, i++)
+		if (i < TOKEN_FOLDED - 1)
+			tok->folded[i] = inside('A', *c, 'Z') ? *c | 0x20 : *c;
+	tok->folded[i < TOKEN_FOLDED - 1 ? i : TOKEN_FOLDED - 1] = '\0';
+	tok->len = i;
 
-	int ind = 0; // operand index
-	int ok = 1;
+	*p = c;
+	return 1;
+}
 
-	while ((token = strtok(NULL, delims)) != NULL) {
-		if (token[0] == ';')
-			break;
+// Returns 2 on empty lines. If an immediate depends on the program size, fix->bits is set and
+// the immediate is left zero (the caller fills in fix->instruction and fix->linenum).
+static int compileLine(bas_ctx *ctx, const char *line, const char *end, size_t instruction_num, fint *ret, Fixup *fix) {
+	*ret = 0;
+	fix->bits = 0;
 
-		switch (opcode) {
-			case OP_FLAG:
-				snprintf(ERROR_TEXT, 255, "Too many parameters (0 expected)");
-				ok = 0;
-				goto cleanup;
-
-			case OP_LDI:
-				if (ind >= 1) {
-					snprintf(ERROR_TEXT, 255, "Too many parameters (1 expected)");
-					ok = 0;
-					goto cleanup;
-				}
-				break;
+	Token tok;
+	if (!nextToken(&line, end, &tok))
+		return 2;
 
-			case OP_NOT:
-			case OP_JMP:
-			case OP_PUSH:
-			case OP_POP:
-				if (ind >= 1) {
-					snprintf(ERROR_TEXT, 255, "Too many parameters (1 expected)");
-					ok = 0;
-					goto cleanup;
-				}
-				break;
+	fint opcode;
+	if (!getOperation(ctx, &tok, &opcode))
+		return 0;
 
-			default:
-				if (ind >= 2) {
-					snprintf(ERROR_TEXT, 255, "Too many parameters (2 expected)");
-					ok = 0;
-					goto cleanup;
-				}
-				break;
-		}
+	// Encode opcode in the top 6 bits
+	*ret = (opcode & 0x3F) << 10;
 
-		switch (opcode) {
-			case OP_LDI: {
-				int val;
-				if (!parseNum(token, &val) && !parseConst(token, program_size, instruction_num, &val)) {
-					ok = 0;
-					goto cleanup;
-				}
-				if (val < 0 || val >= (1 << 16)) {
-					snprintf(ERROR_TEXT, 255, "Number not in range [0, 2^16): '%s' -> %d", token, val);
-					ok = 0;
-					goto cleanup;
-				}
-				*ret |= (fint)val;
-				ind++;
-				break;
-			}
+	const Instr *in = &isa[opcode];
+	int ind = 0; // operand index
 
-			case OP_ADDI:
-			case OP_SUBI:
-			case OP_SHLI:
-			case OP_SHRI:
-				if (ind == 1) {
-					int val;
-					if (!parseNum(token, &val) && !parseConst(token, program_size, instruction_num, &val)) {
-						ok = 0;
-						goto cleanup;
-					}
-					if (val < 0 || val >= (1 << 6)) {
-						snprintf(ERROR_TEXT, 255, "Number not in range [0, 2^6): '%s' -> %d", token, val);
-						ok = 0;
-						goto cleanup;
-					}
-					*ret |= (fint)val << (1 - ind) * 5;
-					ind++;
-					break;
-				}
-				/* fall through */
+	while (nextToken(&line, end, &tok)) {
+		if (ind >= in->arity) {
+			return setError(ctx, BAS_E_TOO_MANY_PARAMS, NULL, 0, in->arity, 0);
+		}
 
-			default: {
-				fint reg;
-				if (!getRegister(token, &reg, use_vars)) {
-					ok = 0;
-					goto cleanup;
-				}
-				*ret |= reg << (1 - ind) * 5;
-				ind++;
+		int kind = in->kind[ind];
+		if (kind == BAS_REG) {
+			fint reg;
+			if (!getRegister(ctx, &tok, &reg))
+				return 0;
+			*ret |= reg << in->shift[ind];
+		} else {
+			int val, bits = operand_bits[kind];
+			int status = parseNum(ctx, &tok, &val);
+			if (!status && !(status = parseConst(ctx, &tok, instruction_num, &val, fix)))
+				return 0;
+			if (status == 2) {
+				fix->bits = bits;
+				fix->token = tok.s;
+				fix->token_len = tok.len;
+			} else if (val < 0 || val >= (1 << bits)) {
+				return setError(ctx, BAS_E_RANGE, tok.s, tok.len, bits, val);
 			}
+			*ret |= (fint)val << in->shift[ind];
 		}
+		ind++;
 	}
 
-	// Final arity checks (too few parameters)
-	switch (opcode) {
-		case OP_FLAG:
-			if (ind != 0) {
-				ok = 0; // already reported above
-			}
-			break;
-
-		case OP_LDI:
-		case OP_NOT:
-		case OP_JMP:
-		case OP_PUSH:
-		case OP_POP:
-			if (ind != 1) {
-				snprintf(ERROR_TEXT, 255, "Too few parameters (1 expected)");
-				ok = 0;
-			}
-			break;
-
-		default:
-			if (ind != 2) {
-				snprintf(ERROR_TEXT, 255, "Too few parameters (2 expected)");
-				ok = 0;
-			}
-			break;
+	if (ind != in->arity) {
+		return setError(ctx, BAS_E_TOO_FEW_PARAMS, NULL, 0, in->arity, 0);
 	}
 
-cleanup:
-	free(lline);
-	return ok;
+	return 1;
 }
 
-int getOperation(char *symbol, fint *ret) {
-	if (strcasecmp(symbol, "LDI") == 0) {
-		*ret = OP_LDI;
-	} else if (strcasecmp(symbol, "MV") == 0) {
-		*ret = OP_MV;
-	} else if (strcasecmp(symbol, "ADD") == 0) {
-		*ret = OP_ADD;
-	} else if (strcasecmp(symbol, "SUB") == 0) {
-		*ret = OP_SUB;
-	} else if (strcasecmp(symbol, "NOT") == 0) {
-		*ret = OP_NOT;
-	} else if (strcasecmp(symbol, "AND") == 0) {
-		*ret = OP_AND;
-	} else if (strcasecmp(symbol, "OR") == 0) {
-		*ret = OP_OR;
-	} else if (strcasecmp(symbol, "XOR") == 0) {
-		*ret = OP_XOR;
-	} else if (strcasecmp(symbol, "SHL") == 0) {
-		*ret = OP_SHL;
-	} else if (strcasecmp(symbol, "SHR") == 0) {
-		*ret = OP_SHR;
-	} else if (strcasecmp(symbol, "JMP") == 0) {
-		*ret = OP_JMP;
-	} else if (strcasecmp(symbol, "JZ") == 0) {
-		*ret = OP_JZ;
-	} else if (strcasecmp(symbol, "JNZ") == 0) {
-		*ret = OP_JNZ;
-	} else if (strcasecmp(symbol, "JN") == 0) {
-		*ret = OP_JN;
-	} else if (strcasecmp(symbol, "JP") == 0) {
-		*ret = OP_JP;
-	} else if (strcasecmp(symbol, "LD") == 0) {
-		*ret = OP_LD;
-	} else if (strcasecmp(symbol, "ST") == 0) {
-		*ret = OP_ST;
-	} else if (strcasecmp(symbol, "PUSH") == 0) {
-		*ret = OP_PUSH;
-	} else if (strcasecmp(symbol, "POP") == 0) {
-		*ret = OP_POP;
-	} else if (strcasecmp(symbol, "ADDI") == 0) {
-		*ret = OP_ADDI;
-	} else if (strcasecmp(symbol, "SUBI") == 0) {
-		*ret = OP_SUBI;
-	} else if (strcasecmp(symbol, "SHLI") == 0) {
-		*ret = OP_SHLI;
-	} else if (strcasecmp(symbol, "SHRI") == 0) {
-		*ret = OP_SHRI;
-	} else if (strcasecmp(symbol, "FLAG") == 0) {
-		*ret = OP_FLAG;
-	} else {
-		snprintf(ERROR_TEXT, 255, "Unknown instruction: '%s'", symbol);
-		return 0;
+// Unused opcodes and words with bits set outside the operand fields decode as ldi of the word
+static const Instr *decodeInstr(fint word) {
+	const Instr *in = &isa[word >> 10];
+	if (!in->len || (word & ~in->used))
+		return &isa[OP_LDI];
+	return in;
+}
+
+void bas_decode(uint16_t word, bas_instr *out) {
+	const Instr *in = decodeInstr(word);
+	if (in == &isa[OP_LDI]) {
+		*out = (bas_instr){.mnemonic = isa[OP_LDI].mnemonic, .opcode = OP_LDI, .handler = HANDLER_LDI, .arity = 1, .kind = {BAS_IMM16}, .operand = {word}};
+		return;
 	}
 
-	return 1;
+	*out = (bas_instr){.mnemonic = in->mnemonic, .opcode = in - isa, .handler = in->handler, .arity = in->arity};
+	for (int i = 0; i < in->arity; i++) {
+		out->kind[i] = in->kind[i];
+		out->operand[i] = (word >> in->shift[i]) & ((1u << operand_bits[in->kind[i]]) - 1);
+	}
 }
 
-int getRegister(char *symbol, fint *ret, bool use_vars) {
-	int n = strlen(symbol);
+static const char reg_names[32][4] = {
+	"r0", "r1", "r2", "r3", "r4", "r5", "r6", "r7", "r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15",
+	"r16", "r17", "r18", "r19", "r20", "r21", "r22", "r23", "r24", "r25", "r26", "r27", "r28", "r29", "sp", "pc",
+};
+
+// Writes one instruction and a newline (at most BAS_DISASM_LINE bytes)
+static char *putInstr(char *p, fint word) {
+	static const char hex[] = "0123456789abcdef";
+	const Instr *in = decodeInstr(word);
+	memcpy(p, in->mnemonic, 4);
+	p += in->len;
+	for (int i = 0; i < in->arity; i++) {
+		*p++ = i ? ',' : ' ';
+		if (i)
+			*p++ = ' ';
+		unsigned v = (word >> in->shift[i]) & ((1u << operand_bits[in->kind[i]]) - 1);
+		switch (in->kind[i]) {
+			case BAS_REG:
+				memcpy(p, reg_names[v], 4);
+				p += v >= 10 && v < 30 ? 3 : 2;
+				break;
+			case BAS_IMM6:
+				if (v >= 10)
+					*p++ = '0' + v / 10;
+				*p++ = '0' + v % 10;
+				break;
+			default: // ldi: the whole word, in hex
+				memcpy(p, "0x", 2);
+				p[2] = hex[v >> 12];
+				p[3] = hex[v >> 8 & 15];
+				p[4] = hex[v >> 4 & 15];
+				p[5] = hex[v & 15];
+				p += 6;
+		}
+	}
+	*p++ = '\n';
+	return p;
+}
+
+size_t bas_disassemble(const char *name, int offset, const uint16_t *code, size_t count, char *buf, size_t cap) {
+	size_t name_len = strnlen(name, 254);
+	if (cap < BAS_DISASM_CAP(count))
+		return 0;
+
+	char *p = buf + name_len;
+	memcpy(buf, name, name_len);
+	p += sprintf(p, " %d\n", offset);
+	for (size_t i = 0; i < count; i++)
+		p = putInstr(p, code[i]);
+	*p = '\0';
+	return p - buf;
+}
+
+_Static_assert(sizeof(bas_bundle_header) == 24, "bas_bundle_header has padding");
+_Static_assert(sizeof(bas_bundle_entry) == 32, "bas_bundle_entry has padding");
+
+uint32_t bas_bundle_hash(const char *name) {
+	uint32_t h = 2166136261u; // FNV-1a
+	for (; *name; name++)
+		h = (h ^ (unsigned char)*name) * 16777619u;
+	return h;
+}
+
+static const bas_bundle_entry *bundleEntries(const unsigned char *data) {
+	return (const bas_bundle_entry *)(data + sizeof(bas_bundle_header));
+}
+
+// Orders entries like the index: by hash, then by name
+static int compareBundleKey(uint32_t hash, const char *name, const unsigned char *data, const bas_bundle_entry *e) {
+	if (hash != e->hash)
+		return hash < e->hash ? -1 : 1;
+	return strcmp(name, (const char *)data + e->name);
+}
+
+int bas_bundle_open(bas_bundle *bundle, const void *data, size_t len) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	(void)bundle, (void)data, (void)len;
+	return 0; // the views would have to be byte swapped
+#else
+	const unsigned char *p = data;
+	const bas_bundle_header *h = data;
+	if ((uintptr_t)p % 8 || len < sizeof(*h) || memcmp(h->magic, BAS_BUNDLE_MAGIC, 4) != 0 ||
+		h->version != BAS_BUNDLE_VERSION || h->size > len)
+		return 0;
+	len = h->size;
+	if (h->names > len || h->names < sizeof(*h) || (h->names - sizeof(*h)) / sizeof(bas_bundle_entry) < h->count)
+		return 0;
+
+	const bas_bundle_entry *e = bundleEntries(p);
+	for (size_t i = 0; i < h->count; i++) {
+		if (e[i].name < h->names || e[i].name >= len || !memchr(p + e[i].name, '\0', len - e[i].name))
+			return 0;
+		if (e[i].image % 2 || e[i].image > len || (len - e[i].image) / 2 < e[i].size)
+			return 0;
+		// bas_bundle_find relies on the order
+		const char *name = (const char *)p + e[i].name;
+		if (e[i].hash != bas_bundle_hash(name) || (i && compareBundleKey(e[i].hash, name, p, &e[i - 1]) <= 0))
+			return 0;
+	}
+	bundle->data = p;
+	bundle->len = len;
+	bundle->count = h->count;
+	return 1;
+#endif
+}
+
+void bas_bundle_get(const bas_bundle *bundle, size_t i, bas_bundle_bot *bot) {
+	const bas_bundle_entry *e = bundleEntries(bundle->data) + i;
+	bot->name = (const char *)bundle->data + e->name;
+	bot->code = (const uint16_t *)(bundle->data + e->image);
+	bot->size = e->size;
+	bot->offset = e->offset;
+	bot->random_offset = e->flags & BAS_BIN_RANDOM_OFFSET;
+}
+
+int bas_bundle_find(const bas_bundle *bundle, const char *name, bas_bundle_bot *bot) {
+	const bas_bundle_entry *e = bundleEntries(bundle->data);
+	uint32_t hash = bas_bundle_hash(name);
+	size_t low = 0, high = bundle->count;
+	while (low < high) {
+		size_t mid = low + (high - low) / 2;
+		int cmp = compareBundleKey(hash, name, bundle->data, &e[mid]);
+		if (cmp == 0) {
+			bas_bundle_get(bundle, mid, bot);
+			return 1;
+		}
+		if (cmp < 0)
+			high = mid;
+		else
+			low = mid + 1;
+	}
+	return 0;
+}
+
+static int getOperation(bas_ctx *ctx, const Token *tok, fint *ret) {
+	if (tok->len > 4)
+		goto unknown;
+
+	uint32_t key = 0;
+	for (int i = 0; i < tok->len; i++)
+		key |= (uint32_t)(unsigned char)tok->folded[i] << 8 * i;
+
+	switch (key) {
+#define X(name, code, a, b, c, d, ...) \
+	case MNEMONIC(a, b, c, d):         \
+		*ret = OP_##name;              \
+		return 1;
+		OPERATIONS(X)
+#undef X
+	}
+
+unknown:
+	return setError(ctx, BAS_E_UNKNOWN_INSTRUCTION, tok->s, tok->len, 0, 0);
+}
+
+static int getRegister(bas_ctx *ctx, const Token *tok, fint *ret) {
+	const char *symbol = tok->s;
+	int n = tok->len;
 	if (!n)
 		return 0;
 
@@ -589,104 +1219,2208 @@ int getRegister(char *symbol, fint *ret, bool use_vars) {
 			*ret = num;
 			return 1;
 		} else {
-			snprintf(ERROR_TEXT, 255, "Unknown register: '%s'", symbol);
-			return 0;
+			return setError(ctx, BAS_E_UNKNOWN_REGISTER, symbol, n, 0, 0);
 		}
 	}
 
 special_name:;
-	if (use_vars && (isdigit(symbol[0]) || symbol[0] == '#')) {
-		snprintf(ERROR_TEXT, 255, "Invalid variable name (starts with a digit or #): '%s'", symbol);
-		return 0;
+	ctx->line_depends = true;
+	if (ctx->vars && (isdigit((unsigned char)symbol[0]) || symbol[0] == '#')) {
+		return setError(ctx, BAS_E_VARIABLE_NAME, symbol, n, 0, 0);
 	}
-	int empty = -1;
-	for (int i = 1; i < 32; i++) {
-		if (strcasecmp(variables[i], symbol) == 0) {
-			*ret = i;
-			return 1;
-		}
-		if (variables[i][0] == 0 && empty == -1)
-			empty = i;
+	int reg = lookupVariable(&ctx->variables, symbol, n);
+	if (reg != -1) {
+		*ret = reg;
+		return 1;
 	}
-	if (empty == -1) {
-		snprintf(ERROR_TEXT, 255, "Too many variables (maybe #free some?): '%s'", symbol);
-		return 0;
+	if (!ctx->vars) {
+		return setError(ctx, BAS_E_VARIABLES_OFF, symbol, n, 0, 0);
 	}
 
-	if (use_vars) {
-		strncpy(variables[empty], symbol, 254);
-		*ret = empty;
-	} else {
-		snprintf(ERROR_TEXT, 255, "Invalid register (you have variables turned off): '%s'", symbol);
-		return 0;
+	reg = addVariable(ctx, &ctx->variables, symbol, n);
+	if (reg == -1) {
+		return setError(ctx, BAS_E_TOO_MANY_VARIABLES, symbol, n, 0, 0);
+	} else if (reg == -2) {
+		return setError(ctx, BAS_E_OUT_OF_MEMORY, NULL, 0, 0, 0);
 	}
+	*ret = reg;
+	return 1;
+}
+
+// Returns 2 for #size and #after, which can only be resolved at the end (see Fixup)
+static int parseConst(bas_ctx *ctx, const Token *tok, size_t instruction_num, int *ret, Fixup *fix) {
+	if (tok->s[0] != '#')
+		return 0;
 
+	// #name[:change[:multiplier]], an empty or missing argument keeps its default
+	const char *name = tok->s + 1, *end = tok->s + tok->len;
+	const char *colon = memchr(name, ':', end - name);
+	int name_len = (int)((colon ? colon : end) - name);
+	int args[2] = {0, 1}; // change, multiplier
+	for (int i = 0; i < 2 && colon; i++) {
+		const char *arg = colon + 1;
+		colon = memchr(arg, ':', end - arg);
+		Token num = {.s = arg, .len = (int)((colon ? colon : end) - arg)};
+		if (num.len && !parseNum(ctx, &num, &args[i]))
+			return 0;
+	}
+	int change = args[0], multiplier = args[1];
+
+#define IS_CONST(s) (name_len == (int)sizeof(s) - 1 && strncasecmp(name, s, sizeof(s) - 1) == 0)
+	if (IS_CONST("size") || IS_CONST("after")) {
+		fix->after = IS_CONST("after");
+		fix->change = change;
+		fix->multiplier = multiplier;
+		*ret = 0;
+		return 2;
+	} else if (IS_CONST("before")) {
+		ctx->line_before = true;
+		*ret = instruction_num * multiplier + change;
+	} else {
+		return setError(ctx, BAS_E_UNKNOWN_CONSTANT, name, name_len, 0, 0);
+	}
+#undef IS_CONST
 	return 1;
 }
 
-void writeBin(FILE *fout, fint n) {
-	fprintf(fout, "0b");
-	fint mask = (fint)1u << 15;
-	do {
-		fputc((n & mask) ? '1' : '0', fout);
-		mask >>= 1;
-	} while (mask);
+// Literals are parsed 8 characters at a time: a chunk is loaded into one 64 bit word (the first
+// character in the lowest byte), checked with a few masks and folded into its value without a loop.
+#define ONES 0x0101010101010101ull
+
+// Sets the high bit of every byte of x that's strictly between m and n (all of them below 128)
+#define BYTES_BETWEEN(x, m, n) \
+	((ONES * (127 + (n)) - ((x) & ONES * 127)) & ~(x) & (((x) & ONES * 127) + ONES * (127 - (m))) & ONES * 128)
+
+// Loads n (1 to 8) characters into the low end of a word with '0' in front, which doesn't change the value
+static uint64_t loadChunk(const char *s, int n) {
+	unsigned char b[8];
+	memset(b, '0', 8 - n);
+	memcpy(b + 8 - n, s, n);
+	uint64_t x = 0;
+	for (int i = 0; i < 8; i++)
+		x |= (uint64_t)b[i] << 8 * i;
+	return x;
 }
 
-int parseConst(char *s, size_t program_size, size_t instruction_num, int *ret) {
-	char const_name[255];
-	int change = 0, multiplier = 1;
-	if (s[0] != '#')
-		return 0;
-	sscanf(s, "#%254[^:]:%d:%d", const_name, &change, &multiplier);
-	if (strcasecmp(const_name, "size") == 0) {
-		*ret = program_size * multiplier + change;
-	} else if (strcasecmp(const_name, "before") == 0) {
-		*ret = instruction_num * multiplier + change;
-	} else if (strcasecmp(const_name, "after") == 0) {
-		*ret = (program_size - instruction_num - 1) * multiplier + change;
+// The value of 8 digits, -1 if one of them isn't a digit of the base
+static int64_t binaryChunk(uint64_t x) {
+	if ((x & ~ONES) != ONES * '0')
+		return -1;
+	return (int64_t)(((x & ONES) * 0x8040201008040201ull) >> 56); // gathers bit 0 of each byte, first one on top
+}
+
+static int64_t decimalChunk(uint64_t x) {
+	if (BYTES_BETWEEN(x, '0' - 1, '9' + 1) != ONES * 128)
+		return -1;
+	x -= ONES * '0';
+	x = (x * 10 + (x >> 8)) & 0x00FF00FF00FF00FFull; // pairs of digits
+	x = (x * 100 + (x >> 16)) & 0x0000FFFF0000FFFFull; // groups of 4
+	return (int64_t)((x * 10000 + (x >> 32)) & 0xFFFFFFFF);
+}
+
+static int64_t hexChunk(uint64_t x) {
+	uint64_t digits = BYTES_BETWEEN(x, '0' - 1, '9' + 1);
+	uint64_t letters = BYTES_BETWEEN(x | ONES * 0x20, 'a' - 1, 'f' + 1);
+	if ((digits | letters) != ONES * 128)
+		return -1;
+	x = (x & ONES * 0x0F) + (letters >> 7) * 9;
+	x = (x & 0x000F000F000F000Full) << 4 | (x >> 8 & 0x000F000F000F000Full);
+	x = (x & 0x000000FF000000FFull) << 8 | (x >> 16 & 0x000000FF000000FFull);
+	return (int64_t)((x & 0xFFFF) << 16 | (x >> 32 & 0xFFFF));
+}
+
+// Adds the n digits at s to *val (base 2, 10 or 16), which stops at max, so a number too big for
+// any immediate is still a number and the caller reports it as out of range. Returns 0 if one isn't a digit.
+static int parseDigits(const char *s, int n, int base, uint64_t max, uint64_t *val) {
+	static const uint32_t pow10[9] = {1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000};
+	uint64_t v = *val;
+	// The short chunk goes first, so only it needs padding. v stays at most 2^31 (max is at most that), so
+	// shifting in another chunk can't overflow.
+	for (int r = (n - 1) % 8 + 1; n > 0; s += r, n -= r, r = 8) {
+		uint64_t x = loadChunk(s, r);
+		int64_t chunk = base == 2 ? binaryChunk(x) : base == 10 ? decimalChunk(x) : hexChunk(x);
+		if (chunk < 0)
+			return 0;
+		v = (base == 10 ? v * pow10[r] : v << (base == 2 ? r : 4 * r)) + (uint64_t)chunk;
+		if (v > max)
+			v = max;
+	}
+	*val = v;
+	return 1;
+}
+
+static int parseNum(bas_ctx *ctx, const Token *tok, int *ret) {
+	const char *s = tok->s;
+	int n = tok->len;
+	uint64_t val = 0;
+
+	if (n > 1 && s[0] == '0' && s[1] == 'b') {
+		// Binary, dots only separate groups of digits
+		for (const char *p = s + 2, *end = s + n; p < end;) {
+			const char *dot = memchr(p, '.', end - p);
+			if (!dot)
+				dot = end;
+			if (!parseDigits(p, (int)(dot - p), 2, INT_MAX, &val))
+				return setError(ctx, BAS_E_BINARY, s, n, 0, 0);
+			p = dot + 1;
+		}
+	} else if (n > 1 && s[0] == '0' && s[1] == 'x') {
+		// Hexadecimal
+		if (n == 2 || !parseDigits(s + 2, n - 2, 16, INT_MAX, &val))
+			return setError(ctx, BAS_E_HEX, s, n, 0, 0);
 	} else {
-		snprintf(ERROR_TEXT, 255, "Unknown compile-time constant '%s'", const_name);
-		return 0;
+		// Decimal, with an optional sign
+		bool negative = n > 0 && s[0] == '-';
+		int sign = n > 0 && (s[0] == '-' || s[0] == '+');
+		if (n == sign || !parseDigits(s + sign, n - sign, 10, (uint64_t)INT_MAX + negative, &val))
+			return setError(ctx, BAS_E_DECIMAL, s, n, 0, 0);
+		if (negative) {
+			*ret = (int)(-(int64_t)val);
+			return 1;
+		}
 	}
+	*ret = (int)val;
 	return 1;
 }
 
-int parseNum(char *s, int *ret) {
-	char *endptr;
+#ifndef BAS_NO_MAIN
+
+// Everything below is the command line interface; it only talks to the assembler through battelasm.h.
+
+#ifndef _WIN32
+#include <dirent.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <utime.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+#else
+#include <fcntl.h>
+#include <io.h>
+#endif
+
+// Output formats (-format=): the C array, the raw image with a bas_bin_header or an x86-64 object
+// file defining the same symbols as the C code
+enum {
+	FORMAT_C,
+	FORMAT_BIN,
+	FORMAT_ELF,
+	FORMAT_CSTRING, // C with the image as a string literal, which compiles much faster
+};
+static const char *const format_names[] = {[FORMAT_C] = "c", [FORMAT_BIN] = "bin", [FORMAT_ELF] = "elf", [FORMAT_CSTRING] = "cstring"};
+static const char *const format_extensions[] = {[FORMAT_C] = ".c", [FORMAT_BIN] = ".bin", [FORMAT_ELF] = ".o", [FORMAT_CSTRING] = ".c"};
+#define FORMATS (sizeof(format_names) / sizeof(*format_names))
 
-	errno = 0;
+#define CACHE_LINE 64 // -const images are aligned to it
 
-	if (s[0] == '0' && s[1] == 'b') {
-		// Binary
-		long val = 0;
-		for (int i = 2; s[i]; i++) {
-			if (s[i] == '0' || s[i] == '1') {
-				val = val * 2 + (s[i] - '0');
-			} else if (s[i] != '.') {
-				snprintf(ERROR_TEXT, sizeof(ERROR_TEXT), "Invalid binary number: %s", s);
-				return 0;
+typedef struct {
+	bool comments, var_table, decimal_instr, vars;
+	int format;
+	bool constant; // -const: read-only, aligned images and enum sizes
+	const char *registry; // -registry: where the bot table goes (images then have external linkage)
+	const char *bundle; // -bundle: where all images go instead of their own outputs
+	bool decoded; // -decoded: also a pre-decoded copy of the image
+	bool map; // -map: write a source map next to every input
+	const char *output; // -o: the output of a single input (else stdout, or next to the input with -watch)
+	bool check; // only report errors (all of them), no output
+	const char *cache_dir; // NULL if the cache is off
+} Options;
+
+// Build cache: outputs are stored under a hash of the (normalized) source and the options
+// that affect the output, so unchanged bots skip assembling entirely.
+#define CACHE_VERSION 4
+typedef struct {
+#ifndef _WIN32
+	atomic_size_t hits, misses, stored, evicted;
+#else
+	size_t hits, misses, stored, evicted;
+#endif
+} CacheStats;
+
+static CacheStats cache_stats;
+
+// -allocstats: the allocation counters of every context, added up when it's freed
+typedef struct {
+#ifndef _WIN32
+	atomic_size_t contexts, programs, allocs, mallocs, frees, bytes;
+#else
+	size_t contexts, programs, allocs, mallocs, frees, bytes;
+#endif
+} AllocStats;
+
+static AllocStats alloc_stats;
+
+static void freeContext(bas_ctx *ctx) {
+	bas_stats st;
+	bas_get_stats(ctx, &st);
+	alloc_stats.contexts++;
+	alloc_stats.programs += st.programs;
+	alloc_stats.allocs += st.allocs;
+	alloc_stats.mallocs += st.mallocs;
+	alloc_stats.frees += st.frees;
+	alloc_stats.bytes += st.bytes;
+	bas_free(ctx);
+}
+
+// The input is mapped (or read) once and handed to bas_assemble as one buffer
+typedef struct {
+	const char *data; // not null terminated when mapped
+	size_t len;
+	bool mapped;
+	bool owned; // read into a malloc-ed buffer (even an empty one)
+} Source;
+
+// The C output of a program is formatted into one buffer, which is then written with a single call
+// (to the output and to the cache). Every thread keeps one and reuses it for all its programs.
+typedef struct {
+	char *data;
+	size_t len, cap;
+} OutBuf;
+
+// -registry and -bundle: what the table or the bundle needs to know about every bot
+typedef struct {
+	char name[255];
+	size_t size;
+	int offset;
+	bool random_offset;
+	uint16_t *code; // a copy of the image with -bundle, else NULL
+} RegistryEntry;
+
+// Batch mode: several inputs assembled by a pool of threads, each output written next to its input
+typedef struct {
+	char **paths;
+	size_t count;
+	Options *opts;
+	RegistryEntry *entries; // one per path with -registry or -bundle, else NULL
+#ifndef _WIN32
+	atomic_size_t next, failed;
+#else
+	size_t next, failed;
+#endif
+} Batch;
+
+int compileFile(bas_ctx *ctx, OutBuf *out, FILE *fin, const char *in_path, const char *out_path, const char *label, Options *opts, bas_result *ret);
+int watchFile(const char *path, Options *opts);
+int disassembleFile(const char *path);
+int compileBatch(char **inputs, size_t count, Options *opts, int jobs);
+int serve(FILE *in, FILE *out, bas_ctx *ctx);
+int serveSocket(const char *path, bas_ctx *ctx);
+int readInput(FILE *fin, char **ret, size_t *len);
+int openSource(FILE *fin, Source *src);
+void closeSource(Source *src);
+int cacheEvict(const char *dir, uint64_t max_size);
+
+int main(int argc, char *argv[]) {
+	int argi = 1;
+	int jobs = 0;
+	bool server = false, cache_stats_on = false, alloc_stats_on = false, watch = false, disasm = false;
+	const char *socket_path = NULL;
+	uint64_t cache_size = 64u << 20;
+	Options opts = {.comments = true, .var_table = false, .decimal_instr = false, .vars = true, .format = FORMAT_C, .constant = false, .decoded = false, .registry = NULL, .bundle = NULL, .map = false, .output = NULL, .check = false, .cache_dir = NULL};
+
+	for (; argi < argc; argi++) {
+		char *p = argv[argi];
+		if (p[0] != '-' || strcmp(p, "-") == 0) // "-" is stdin
+			break;
+		if (strcmp(p, "-nocomments") == 0)
+			opts.comments = false;
+		else if (strcmp(p, "-vartable") == 0)
+			opts.var_table = true;
+		else if (strcmp(p, "-novars") == 0)
+			opts.vars = false;
+		else if (strcmp(p, "-decimal") == 0)
+			opts.decimal_instr = true;
+		else if (strcmp(p, "-obfuscate") == 0) {
+			opts.comments = false;
+			opts.decimal_instr = true;
+		} else if (strcmp(p, "-j") == 0) {
+			if (argi + 1 >= argc || (jobs = atoi(argv[argi + 1])) <= 0) {
+				fprintf(stderr, "-j needs a positive number of threads\n");
+				goto usage;
+			}
+			argi++;
+		} else if (strcmp(p, "-server") == 0)
+			server = true;
+		else if (strcmp(p, "-watch") == 0)
+			watch = true;
+		else if (strcmp(p, "-disasm") == 0)
+			disasm = true;
+		else if (strcmp(p, "-check") == 0)
+			opts.check = true;
+		else if (strcmp(p, "-const") == 0)
+			opts.constant = true;
+		else if (strcmp(p, "-map") == 0)
+			opts.map = true;
+		else if (strcmp(p, "-decoded") == 0)
+			opts.decoded = true;
+		else if (strcmp(p, "-registry") == 0) {
+			if (argi + 1 >= argc) {
+				fprintf(stderr, "-registry needs a path\n");
+				goto usage;
+			}
+			opts.registry = argv[++argi];
+			opts.constant = true;
+		} else if (strcmp(p, "-o") == 0) {
+			if (argi + 1 >= argc) {
+				fprintf(stderr, "-o needs a path\n");
+				goto usage;
+			}
+			opts.output = argv[++argi];
+		} else if (strcmp(p, "-bundle") == 0) {
+			if (argi + 1 >= argc) {
+				fprintf(stderr, "-bundle needs a path\n");
+				goto usage;
+			}
+			opts.bundle = argv[++argi];
+		} else if (strncmp(p, "-format=", 8) == 0) {
+			for (opts.format = 0; opts.format < (int)FORMATS && strcmp(p + 8, format_names[opts.format]) != 0; opts.format++)
+				;
+			if (opts.format == (int)FORMATS) {
+				fprintf(stderr, "Unknown format '%s' (c, bin, elf or cstring)\n", p + 8);
+				goto usage;
+			}
+		} else if (strcmp(p, "-socket") == 0) {
+			if (argi + 1 >= argc) {
+				fprintf(stderr, "-socket needs a path\n");
+				goto usage;
 			}
+			socket_path = argv[++argi];
+		} else if (strcmp(p, "-cache") == 0) {
+			if (argi + 1 >= argc) {
+				fprintf(stderr, "-cache needs a directory\n");
+				goto usage;
+			}
+			opts.cache_dir = argv[++argi];
+		} else if (strcmp(p, "-cachesize") == 0) {
+			if (argi + 1 >= argc || atoi(argv[argi + 1]) <= 0) {
+				fprintf(stderr, "-cachesize needs a positive size in MiB\n");
+				goto usage;
+			}
+			cache_size = (uint64_t)atoi(argv[++argi]) << 20;
+		} else if (strcmp(p, "-cachestats") == 0)
+			cache_stats_on = true;
+		else if (strcmp(p, "-allocstats") == 0)
+			alloc_stats_on = true;
+		else if (strcmp(p, "-help") == 0)
+			goto usage;
+		else {
+			fprintf(stderr, "Unknown parameter '%s'\n", p);
+			goto usage;
 		}
-		*ret = val;
-		return 1;
-	} else if (s[0] == '0' && s[1] == 'x') {
-		// Hexadecimal
-		long val = strtol(s + 2, &endptr, 16);
-		if (*endptr != '\0' || errno != 0) {
-			snprintf(ERROR_TEXT, sizeof(ERROR_TEXT), "Invalid hexadecimal number: %s", s);
-			return 0;
+	}
+
+	if (!opts.vars && opts.var_table) {
+		fprintf(stderr, "-novars and -vartable aren't compatible.\n");
+		goto usage;
+	}
+	if (opts.registry && opts.format == FORMAT_BIN) {
+		fprintf(stderr, "-registry needs an output that can be linked (-format=c, cstring or elf).\n");
+		goto usage;
+	}
+	if (opts.decoded && (opts.bundle || (opts.format != FORMAT_C && opts.format != FORMAT_CSTRING))) {
+		fprintf(stderr, "-decoded needs C output (-format=c or cstring).\n");
+		goto usage;
+	}
+	if (opts.registry && opts.bundle) {
+		fprintf(stderr, "-registry and -bundle aren't compatible.\n");
+		goto usage;
+	}
+	if (watch && (opts.registry || opts.bundle)) {
+		fprintf(stderr, "-watch writes the output of one input, so it doesn't take -registry or -bundle.\n");
+		goto usage;
+	}
+
+	if (server || socket_path) {
+		if (argi < argc) {
+			fprintf(stderr, "Server mode doesn't take input files\n");
+			goto usage;
+		}
+		bas_ctx *ctx = bas_new(&(bas_options){.vars = opts.vars, .seed = (uint32_t)time(0)});
+		if (!ctx) {
+			perror("bas_new");
+			return 1;
 		}
-		*ret = val;
+#ifdef _WIN32
+		_setmode(_fileno(stdin), _O_BINARY);
+		_setmode(_fileno(stdout), _O_BINARY);
+#endif
+		int rc = socket_path ? serveSocket(socket_path, ctx) : serve(stdin, stdout, ctx);
+		bas_free(ctx);
+		return rc != 1;
+	}
+
+	if (argi >= argc) {
+		fprintf(stderr, "Input file not specified.\n");
+		goto usage;
+	}
+
+#ifdef _WIN32
+	if (opts.cache_dir) {
+		fprintf(stderr, "-cache isn't supported on Windows\n");
 		return 1;
+	}
+#endif
+
+#ifdef _WIN32
+	if (opts.format != FORMAT_C)
+		_setmode(_fileno(stdout), _O_BINARY);
+#endif
+
+	if (disasm) {
+		int rc = 0;
+		for (; argi < argc; argi++)
+			rc |= disassembleFile(argv[argi]) != 1;
+		return rc;
+	}
+
+	if (watch) {
+		if (argi < argc - 1 || strcmp(argv[argi], "-") == 0) {
+			fprintf(stderr, "-watch takes a single input file\n");
+			goto usage;
+		}
+		return watchFile(argv[argi], &opts) != 1;
+	}
+
+	int rc;
+#ifndef _WIN32
+	struct stat st;
+	if (argi < argc - 1 || opts.registry || opts.bundle || (stat(argv[argi], &st) == 0 && S_ISDIR(st.st_mode))) {
+#else
+	if (argi < argc - 1 || opts.registry || opts.bundle) {
+#endif
+		if (opts.output) {
+			fprintf(stderr, "-o takes a single input (batch outputs go next to their inputs)\n");
+			goto usage;
+		}
+		rc = compileBatch(argv + argi, argc - argi, &opts, jobs);
 	} else {
-		// Decimal
-		long val = strtol(s, &endptr, 10);
-		if (*endptr != '\0' || errno != 0) {
-			snprintf(ERROR_TEXT, sizeof(ERROR_TEXT), "Invalid decimal number: %s", s);
+		if (opts.map && strcmp(argv[argi], "-") == 0) {
+			fprintf(stderr, "-map needs an input file (the map goes next to it)\n");
+			goto usage;
+		}
+		FILE *fin = strcmp(argv[argi], "-") == 0 ? stdin : fopen(argv[argi], "r");
+		if (!fin) {
+			perror("fopen");
+			return 1;
+		}
+
+		bas_ctx *ctx = bas_new(&(bas_options){.vars = opts.vars, .seed = (uint32_t)time(0)});
+		if (!ctx) {
+			perror("bas_new");
+			return 1;
+		}
+		OutBuf out = {0};
+		rc = compileFile(ctx, &out, fin, fin == stdin ? NULL : argv[argi], opts.output, NULL, &opts, NULL);
+		free(out.data);
+		freeContext(ctx);
+		if (fin != stdin)
+			fclose(fin);
+	}
+
+	if (opts.cache_dir) {
+		cacheEvict(opts.cache_dir, cache_size);
+		if (cache_stats_on)
+			fprintf(stderr, "cache: %zu hits, %zu misses, %zu stored, %zu evicted\n",
+					(size_t)cache_stats.hits, (size_t)cache_stats.misses, (size_t)cache_stats.stored, (size_t)cache_stats.evicted);
+	}
+	if (alloc_stats_on)
+		fprintf(stderr, "alloc: %zu programs in %zu contexts, %zu arena allocations, %zu mallocs, %zu frees, %zu KiB of arenas\n",
+				(size_t)alloc_stats.programs, (size_t)alloc_stats.contexts, (size_t)alloc_stats.allocs, (size_t)alloc_stats.mallocs,
+				(size_t)alloc_stats.frees, (size_t)alloc_stats.bytes >> 10);
+	return rc != 1;
+
+usage:
+	fprintf(stderr, "Usage: %s -help -nocomments [-vartable -novars] -decimal -obfuscate -format=c|bin|elf|cstring -const -decoded -map -check [-o output] [-j threads] [-cache dir -cachesize MiB -cachestats] -allocstats\n"
+					"       [-registry bots_registry.c | -bundle bots.basb] <input.asm | - | inputs... | directory>\n"
+					"       %s [options] -watch <input.asm>\n"
+					"       %s [-novars] -server | -socket <path>\n"
+					"       %s -disasm <image.bin | bots.basb | output.c | ->...\n",
+			argv[0], argv[0], argv[0], argv[0]);
+	return 1;
+}
+
+// Reads the whole input in one go, so pipes and other non-seekable streams work too.
+// The buffer is null terminated.
+int readInput(FILE *fin, char **ret, size_t *len) {
+	size_t cap = 4096;
+	char *buf = malloc(cap);
+	*len = 0;
+	if (!buf) {
+		perror("malloc");
+		return 0;
+	}
+
+	size_t n;
+	while ((n = fread(buf + *len, 1, cap - *len - 1, fin)) > 0) {
+		*len += n;
+		if (cap - *len - 1 == 0) {
+			char *tmp = realloc(buf, cap * 2);
+			if (!tmp) {
+				perror("realloc");
+				free(buf);
+				return 0;
+			}
+			buf = tmp;
+			cap *= 2;
+		}
+	}
+	if (ferror(fin)) {
+		perror("fread");
+		free(buf);
+		return 0;
+	}
+
+	buf[*len] = '\0';
+	*ret = buf;
+	return 1;
+}
+
+// Maps regular files and falls back to readInput() for pipes and terminals
+int openSource(FILE *fin, Source *src) {
+	src->mapped = src->owned = false;
+#ifndef _WIN32
+	struct stat st;
+	int fd = fileno(fin);
+	if (fd != -1 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+		src->len = st.st_size;
+		if (src->len == 0) {
+			src->data = "";
+			return 1;
+		}
+		void *p = mmap(NULL, src->len, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (p != MAP_FAILED) {
+			src->data = p;
+			src->mapped = true;
+			return 1;
+		}
+	}
+#endif
+	char *buf;
+	if (!readInput(fin, &buf, &src->len))
+		return 0;
+	src->data = buf;
+	src->owned = true;
+	return 1;
+}
+
+void closeSource(Source *src) {
+#ifndef _WIN32
+	if (src->mapped) {
+		munmap((void *)src->data, src->len);
+		return;
+	}
+#endif
+	if (src->owned)
+		free((void *)src->data);
+}
+
+// Writes the assembled program as C code
+// "0b" and 16 binary digits is two lookups in a table of the 8 digits of every byte
+#define BIN8(n) {'0' + ((n) >> 7 & 1), '0' + ((n) >> 6 & 1), '0' + ((n) >> 5 & 1), '0' + ((n) >> 4 & 1), \
+				 '0' + ((n) >> 3 & 1), '0' + ((n) >> 2 & 1), '0' + ((n) >> 1 & 1), '0' + ((n) & 1)}
+#define BIN8_2(n) BIN8(n), BIN8((n) + 1)
+#define BIN8_4(n) BIN8_2(n), BIN8_2((n) + 2)
+#define BIN8_16(n) BIN8_4(n), BIN8_4((n) + 4), BIN8_4((n) + 8), BIN8_4((n) + 12)
+#define BIN8_64(n) BIN8_16(n), BIN8_16((n) + 16), BIN8_16((n) + 32), BIN8_16((n) + 48)
+static const char bin_digits[256][8] = {BIN8_64(0), BIN8_64(64), BIN8_64(128), BIN8_64(192)};
+
+static char *putDecimal(char *p, fint n) {
+	char digits[5];
+	int i = sizeof(digits);
+	do {
+		digits[--i] = '0' + n % 10;
+		n /= 10;
+	} while (n);
+	memcpy(p, digits + i, sizeof(digits) - i);
+	return p + sizeof(digits) - i;
+}
+
+// Appends to the buffer like printf. Returns 0 if out of memory.
+static int outPrintf(OutBuf *out, const char *fmt, ...) {
+	for (;;) {
+		va_list ap;
+		va_start(ap, fmt);
+		size_t room = out->cap - out->len;
+		int n = vsnprintf(out->data ? out->data + out->len : NULL, room, fmt, ap);
+		va_end(ap);
+		if (n < 0)
 			return 0;
+		if ((size_t)n < room) {
+			out->len += n;
+			return 1;
 		}
-		*ret = val;
-		return 1;
+		if (!reserve(&out->data, &out->cap, out->len + n + 1, 1))
+			return 0;
+	}
+}
+
+static int writeCFooter(OutBuf *out, const bas_ctx *ctx, const bas_result *res, const Options *opts);
+
+// -decoded: the type of the pre-decoded instructions and a BOT_<MNEMONIC> constant for every handler,
+// guarded so several bots can be included in one file. The names come from bas_decode, so they
+// always match the instruction set.
+static void handlerName(const bas_instr *in, char name[5]) {
+	int i = 0;
+	for (; in->mnemonic[i]; i++)
+		name[i] = in->mnemonic[i] - 'a' + 'A';
+	name[i] = '\0';
+}
+
+static int writeDecodedType(OutBuf *out) {
+	char names[BAS_HANDLERS][5];
+	for (int op = 0; op < 64; op++) { // unused opcodes decode as ldi
+		bas_instr in;
+		bas_decode((uint16_t)(op << 10), &in);
+		handlerName(&in, names[in.handler]);
+	}
+	int ok = outPrintf(out, "\n#ifndef BOT_DECODED\n#define BOT_DECODED\nenum {");
+	for (int i = 0; ok && i < BAS_HANDLERS; i++)
+		ok = outPrintf(out, "%s BOT_%s", i ? "," : "", names[i]);
+	return ok && outPrintf(out, " };\n"
+								"typedef struct {\n"
+								"\tuint8_t opcode; // the top 6 bits (0 for ldi)\n"
+								"\tuint8_t handler; // BOT_LDI to BOT_FLAG\n"
+								"\tuint8_t dst, src; // register operands (0 if unused)\n"
+								"\tuint16_t imm; // the word for ldi, the 6 bit immediate for addi, subi, shli and shri (bit 5 is also bit 0 of dst)\n"
+								"} bot_decoded;\n"
+								"#endif\n");
+}
+
+// <name>_decoded: the image decoded instruction by instruction, so an interpreter can fill its
+// decode cache when it loads the bot instead of decoding every word the first time it runs
+static int writeDecoded(OutBuf *out, const bas_result *res, const Options *opts) {
+	if (!writeDecodedType(out))
+		return 0;
+	if (!(opts->constant ? outPrintf(out, "%s_Alignas(%d) const bot_decoded %s_decoded[] = {\n", opts->registry ? "" : "static ", CACHE_LINE, res->name)
+						 : outPrintf(out, "static const bot_decoded %s_decoded[] = {\n", res->name)))
+		return 0;
+	for (size_t i = 0; i < res->size; i++) {
+		bas_instr in;
+		char name[5];
+		bas_decode(res->code[i], &in);
+		handlerName(&in, name);
+		unsigned dst = 0, src = 0, imm = 0;
+		for (int j = 0; j < in.arity; j++) {
+			if (in.kind[j] != BAS_REG)
+				imm = in.operand[j];
+			else if (j == 0)
+				dst = in.operand[j];
+			else
+				src = in.operand[j];
+		}
+		if (!outPrintf(out, "\t{0x%02x, BOT_%s, %u, %u, %u},\n", in.opcode, name, dst, src, imm))
+			return 0;
 	}
+	return outPrintf(out, "};\n");
 }
+
+// Formats the C output into out (replacing what was there). Returns 0 if out of memory.
+static int writeC(OutBuf *out, const bas_ctx *ctx, const bas_result *res, const Source *src, const Options *opts) {
+	out->len = 0;
+	if (opts->registry && !outPrintf(out, "#include <stdint.h>\n")) // compiled on its own
+		return 0;
+	if (!(opts->constant ? outPrintf(out, "%s_Alignas(%d) const uint16_t %s_mem[] = {\n", opts->registry ? "" : "static ", CACHE_LINE, res->name)
+						 : outPrintf(out, "static uint16_t %s_mem[] = {\n", res->name)))
+		return 0;
+
+	// Room for every instruction line, so the loop doesn't check
+	size_t need = 0;
+	for (size_t i = 0; i < res->size; i++)
+		need += 32 + (opts->comments && res->lines[i].line ? res->lines[i].len : 0);
+	if (!reserve(&out->data, &out->cap, out->len + need, 1))
+		return 0;
+
+	char *p = out->data + out->len;
+	for (size_t i = 0; i < res->size; i++) {
+		fint word = res->code[i];
+		*p++ = '\t';
+		if (opts->decimal_instr)
+			p = putDecimal(p, word);
+		else {
+			memcpy(p, "0b", 2);
+			memcpy(p + 2, bin_digits[word >> 8], 8);
+			memcpy(p + 10, bin_digits[word & 0xFF], 8);
+			p += 18;
+		}
+		if (opts->comments && res->lines[i].line) {
+			const char *line = src->data + res->lines[i].start;
+			const char *nul = memchr(line, '\0', res->lines[i].len); // where %.*s used to stop
+			size_t len = nul ? (size_t)(nul - line) : res->lines[i].len;
+			memcpy(p, ", // ", 5);
+			memcpy(p + 5, line, len);
+			p += 5 + len;
+			*p++ = '\n';
+		} else {
+			memcpy(p, ",\n", 2);
+			p += 2;
+		}
+	}
+	out->len = p - out->data;
+
+	if (!outPrintf(out, "};\n"))
+		return 0;
+	return writeCFooter(out, ctx, res, opts);
+}
+
+// <name>_size, <name>_offset (constants with -const, so they can be folded) and the variable table
+static int writeCFooter(OutBuf *out, const bas_ctx *ctx, const bas_result *res, const Options *opts) {
+	if (opts->decoded && !writeDecoded(out, res, opts))
+		return 0;
+	if (opts->constant) {
+		if (!outPrintf(out, "enum { %s_size = %zu, %s_offset = %d };\n", res->name, res->size, res->name, res->offset))
+			return 0;
+	} else if (!outPrintf(out, "static uint16_t %s_size = %zu;\n"
+							   "static uint16_t %s_offset = %d;\n",
+						  res->name, res->size, res->name, res->offset))
+		return 0;
+
+	if (opts->var_table) {
+		if (!outPrintf(out, "\n"))
+			return 0;
+		for (int i = 1; i < 30; i++) {
+			const char *name;
+			size_t len = bas_variable(ctx, i, &name);
+			if (len && !outPrintf(out, "// %.*s: r%d\n", (int)len, name, i))
+				return 0;
+		}
+	}
+	return 1;
+}
+
+static void put16(unsigned char *p, uint16_t v) {
+	p[0] = v;
+	p[1] = v >> 8;
+}
+
+static void put32(unsigned char *p, uint32_t v) {
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+static void put64(unsigned char *p, uint64_t v) {
+	put32(p, (uint32_t)v);
+	put32(p + 4, (uint32_t)(v >> 32));
+}
+
+// Appends a byte to a string literal: printable characters as they are, the rest (and the ones that
+// would need care: '"', '\\' and '?' for trigraphs) as 3 digit octal escapes, which never take in
+// a digit that follows them.
+static char *putStringByte(char *p, unsigned char c) {
+	if (inside(' ', c, '~') && c != '"' && c != '\\' && c != '?') {
+		*p++ = c;
+		return p;
+	}
+	p[0] = '\\';
+	p[1] = '0' + (c >> 6);
+	p[2] = '0' + (c >> 3 & 7);
+	p[3] = '0' + (c & 7);
+	return p + 4;
+}
+
+// -format=cstring: the same symbols as writeC(), but the words are a string literal in a union, which
+// compilers get through much faster than an initializer per word. <name>_mem is a macro for the
+// uint16_t view, so it still works as an array. With comments every word gets its own line and
+// source line, without them lines hold 32 words.
+static int writeCString(OutBuf *out, const bas_ctx *ctx, const bas_result *res, const Source *src, const Options *opts) {
+	char align[32] = "";
+	if (opts->constant)
+		snprintf(align, sizeof(align), "_Alignas(%d) ", CACHE_LINE);
+	out->len = 0;
+	if (opts->registry && !outPrintf(out, "#include <stdint.h>\n"))
+		return 0;
+	if (!outPrintf(out, "#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__\n"
+						"#error \"%s_blob holds little endian words\"\n"
+						"#endif\n"
+						"%s%sconst union {\n"
+						"\tchar s[%zu];\n"
+						"\tuint16_t w[%zu];\n"
+						"} %s_blob = {\n",
+				   res->name, opts->registry ? "" : "static ", align,
+				   2 * res->size, res->size, res->name))
+		return 0;
+
+	size_t need = 0;
+	for (size_t i = 0; i < res->size; i++)
+		need += 16 + (opts->comments && res->lines[i].line ? 8 + res->lines[i].len : 0);
+	if (!reserve(&out->data, &out->cap, out->len + need, 1))
+		return 0;
+
+	char *p = out->data + out->len;
+	int words = 0; // on the current line
+	for (size_t i = 0; i < res->size; i++) {
+		bool comment = opts->comments && res->lines[i].line;
+		if (words++ == 0) {
+			*p++ = '\t';
+			*p++ = '"';
+		}
+		p = putStringByte(p, res->code[i] & 0xFF);
+		p = putStringByte(p, res->code[i] >> 8);
+		if (comment) {
+			const char *line = src->data + res->lines[i].start;
+			const char *nul = memchr(line, '\0', res->lines[i].len);
+			size_t len = nul ? (size_t)(nul - line) : res->lines[i].len;
+			memcpy(p, "\" // ", 5);
+			memcpy(p + 5, line, len);
+			p += 5 + len;
+			*p++ = '\n';
+			words = 0;
+		} else if (words == 32 || i + 1 == res->size || (opts->comments && res->lines[i + 1].line)) {
+			memcpy(p, "\"\n", 2);
+			p += 2;
+			words = 0;
+		}
+	}
+	out->len = p - out->data;
+
+	if (!outPrintf(out, "};\n"
+						"#define %s_mem (%s_blob.w)\n",
+				   res->name, res->name))
+		return 0;
+	return writeCFooter(out, ctx, res, opts);
+}
+
+_Static_assert(sizeof(bas_bin_header) == 272, "bas_bin_header has padding");
+
+// Formats the -format=bin image into out: the bas_bin_header and the words, all little endian
+static int writeImage(OutBuf *out, const bas_result *res) {
+	out->len = sizeof(bas_bin_header) + 2 * res->size;
+	if (!reserve(&out->data, &out->cap, out->len, 1))
+		return 0;
+	unsigned char *p = (unsigned char *)out->data;
+	memset(p, 0, sizeof(bas_bin_header));
+	memcpy(p + offsetof(bas_bin_header, magic), BAS_BIN_MAGIC, 4);
+	put16(p + offsetof(bas_bin_header, version), BAS_BIN_VERSION);
+	put16(p + offsetof(bas_bin_header, flags), res->random_offset ? BAS_BIN_RANDOM_OFFSET : 0);
+	put32(p + offsetof(bas_bin_header, size), (uint32_t)res->size);
+	put32(p + offsetof(bas_bin_header, offset), (uint32_t)res->offset);
+	memcpy(p + offsetof(bas_bin_header, name), res->name, strlen(res->name));
+	p += sizeof(bas_bin_header);
+	for (size_t i = 0; i < res->size; i++, p += 2)
+		put16(p, res->code[i]);
+	return 1;
+}
+
+// -format=elf: an x86-64 relocatable object with <name>_mem, <name>_size and <name>_offset as global
+// symbols in .rodata (the words, then size and offset as uint16_t). Nothing in it needs relocating.
+// Sections: null, .rodata, .note.GNU-stack (so the stack isn't made executable), .symtab, .strtab
+// and .shstrtab. The structures are written field by field, so this works without <elf.h>.
+#define ELF_EHDR 64
+#define ELF_SHDR 64
+#define ELF_SYM 24
+#define ELF_SECTIONS 6
+#define ALIGN8(n) (((n) + 7) & ~(size_t)7)
+
+static void putSection(unsigned char *sh, uint32_t name, uint32_t type, uint64_t flags, size_t offset, size_t size,
+					   uint32_t link, uint32_t info, uint64_t align, uint64_t entsize) {
+	put32(sh, name);
+	put32(sh + 4, type);
+	put64(sh + 8, flags);
+	put64(sh + 24, offset);
+	put64(sh + 32, size);
+	put32(sh + 40, link);
+	put32(sh + 44, info);
+	put64(sh + 48, align);
+	put64(sh + 56, entsize);
+}
+
+static int writeElf(OutBuf *out, const bas_result *res, const Options *opts) {
+	static const char shstrtab[] = "\0.rodata\0.note.GNU-stack\0.symtab\0.strtab\0.shstrtab";
+	enum { SH_RODATA = 1, SH_NOTE = 9, SH_SYMTAB = 25, SH_STRTAB = 33, SH_SHSTRTAB = 41 }; // names in shstrtab
+	static const char *const suffixes[] = {"_mem", "_size", "_offset"};
+
+	size_t name_len = strlen(res->name);
+	size_t rodata = ELF_EHDR, rodata_size = 2 * res->size + 4;
+	size_t symtab = ALIGN8(rodata + rodata_size), symtab_size = 4 * ELF_SYM; // the null symbol and 3 globals
+	size_t strtab = symtab + symtab_size, strtab_size = 1 + 3 * name_len + sizeof("_mem_size_offset") - 1 + 3;
+	size_t shstr = strtab + strtab_size;
+	size_t shdrs = ALIGN8(shstr + sizeof(shstrtab));
+	out->len = shdrs + ELF_SECTIONS * ELF_SHDR;
+	if (!reserve(&out->data, &out->cap, out->len, 1))
+		return 0;
+	unsigned char *p = (unsigned char *)out->data;
+	memset(p, 0, out->len);
+
+	memcpy(p, "\x7f" "ELF\x02\x01\x01", 7); // 64 bit, little endian, version 1
+	put16(p + 16, 1); // ET_REL
+	put16(p + 18, 62); // EM_X86_64
+	put32(p + 20, 1);
+	put64(p + 40, shdrs);
+	put16(p + 52, ELF_EHDR);
+	put16(p + 58, ELF_SHDR);
+	put16(p + 60, ELF_SECTIONS);
+	put16(p + 62, ELF_SECTIONS - 1); // .shstrtab
+
+	unsigned char *q = p + rodata;
+	for (size_t i = 0; i < res->size; i++, q += 2)
+		put16(q, res->code[i]);
+	put16(q, (uint16_t)res->size);
+	put16(q + 2, (uint16_t)res->offset);
+
+	size_t values[] = {0, 2 * res->size, 2 * res->size + 2}, sizes[] = {2 * res->size, 2, 2};
+	char *str = (char *)p + strtab + 1;
+	for (int i = 0; i < 3; i++) {
+		unsigned char *sym = p + symtab + (i + 1) * ELF_SYM;
+		put32(sym, (uint32_t)(str - ((char *)p + strtab)));
+		sym[4] = 1 << 4 | 1; // STB_GLOBAL, STT_OBJECT
+		put16(sym + 6, 1); // .rodata
+		put64(sym + 8, values[i]);
+		put64(sym + 16, sizes[i]);
+		memcpy(str, res->name, name_len);
+		strcpy(str + name_len, suffixes[i]);
+		str += name_len + strlen(suffixes[i]) + 1;
+	}
+	memcpy(p + shstr, shstrtab, sizeof(shstrtab));
+
+	unsigned char *sh = p + shdrs + ELF_SHDR; // the first one stays null
+	putSection(sh, SH_RODATA, 1, 2, rodata, rodata_size, 0, 0, opts->constant ? CACHE_LINE : 2, 0); // SHT_PROGBITS, SHF_ALLOC
+	putSection(sh + ELF_SHDR, SH_NOTE, 1, 0, rodata + rodata_size, 0, 0, 0, 1, 0);
+	putSection(sh + 2 * ELF_SHDR, SH_SYMTAB, 2, 0, symtab, symtab_size, 4, 1, 8, ELF_SYM); // SHT_SYMTAB, first global is 1
+	putSection(sh + 3 * ELF_SHDR, SH_STRTAB, 3, 0, strtab, strtab_size, 0, 0, 1, 0); // SHT_STRTAB
+	putSection(sh + 4 * ELF_SHDR, SH_SHSTRTAB, 3, 0, shstr, sizeof(shstrtab), 0, 0, 1, 0);
+	return 1;
+}
+
+_Static_assert(sizeof(bas_map_header) == 16 && sizeof(bas_map_entry) == 8, "source map structures have padding");
+
+// Formats the -map source map of the program (see bas_map_header) into out. Returns 0 if out of memory.
+static int writeMap(OutBuf *out, const bas_ctx *ctx, const bas_result *res, const Source *src, const char *in_path) {
+	const char *name;
+	size_t file = strlen(in_path), len, vars = 0, vars_size = 0;
+	if (file > UINT16_MAX)
+		file = UINT16_MAX;
+	for (int i = 1; i < 30; i++) // like -vartable, without sp and pc
+		if ((len = bas_variable(ctx, i, &name))) {
+			vars++;
+			vars_size += 4 + (len < UINT16_MAX ? len : UINT16_MAX);
+		}
+
+	size_t entries = sizeof(bas_map_header);
+	out->len = entries + res->size * sizeof(bas_map_entry) + file + vars_size;
+	if (!reserve(&out->data, &out->cap, out->len, 1))
+		return 0;
+	unsigned char *p = (unsigned char *)out->data;
+	memcpy(p + offsetof(bas_map_header, magic), BAS_MAP_MAGIC, 4);
+	put16(p + offsetof(bas_map_header, version), BAS_MAP_VERSION);
+	put16(p + offsetof(bas_map_header, file), (uint16_t)file);
+	put32(p + offsetof(bas_map_header, count), (uint32_t)res->size);
+	put32(p + offsetof(bas_map_header, vars), (uint32_t)vars);
+
+	p += entries;
+	for (size_t i = 0; i < res->size; i++, p += sizeof(bas_map_entry)) {
+		const bas_line *l = &res->lines[i];
+		size_t start = 0, end = 0;
+		if (l->line) {
+			const char *line = src->data + l->start;
+			while (start < l->len && (line[start] == ' ' || line[start] == '\t'))
+				start++;
+			for (end = start; end < l->len && line[end] != ';'; end++)
+				;
+			while (end > start && (line[end - 1] == ' ' || line[end - 1] == '\t' || line[end - 1] == '\r'))
+				end--;
+		}
+		size_t column = l->line ? start + 1 : 0;
+		put32(p + offsetof(bas_map_entry, line), (uint32_t)l->line);
+		put16(p + offsetof(bas_map_entry, column), column < UINT16_MAX ? (uint16_t)column : UINT16_MAX);
+		put16(p + offsetof(bas_map_entry, len), end - start < UINT16_MAX ? (uint16_t)(end - start) : UINT16_MAX);
+	}
+	memcpy(p, in_path, file);
+	p += file;
+	for (int i = 1; i < 30; i++)
+		if ((len = bas_variable(ctx, i, &name))) {
+			if (len > UINT16_MAX)
+				len = UINT16_MAX;
+			put16(p, (uint16_t)i);
+			put16(p + 2, (uint16_t)len);
+			memcpy(p + 4, name, len);
+			p += 4 + len;
+		}
+	return 1;
+}
+
+static int writeOutput(OutBuf *out, const bas_ctx *ctx, const bas_result *res, const Source *src, const Options *opts) {
+	switch (opts->format) {
+		case FORMAT_BIN:
+			return writeImage(out, res);
+		case FORMAT_ELF:
+			return writeElf(out, res, opts);
+		case FORMAT_CSTRING:
+			return writeCString(out, ctx, res, src, opts);
+		default:
+			return writeC(out, ctx, res, src, opts);
+	}
+}
+
+typedef struct {
+	uint64_t a, b;
+} Hash128;
+
+static void hashByte(Hash128 *h, unsigned char c) {
+	h->a = (h->a ^ c) * 0x100000001b3ull; // FNV-1a
+	h->b = (h->b + c + 1) * 0x9e3779b97f4a7c15ull;
+	h->b ^= h->b >> 29;
+}
+
+static uint64_t mix64(uint64_t x) { // splitmix64 finalizer
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+	return x ^ (x >> 31);
+}
+
+// Computes the cache key of a source as 32 hex digits. Without comments in the output, whitespace,
+// commas, comments and empty lines don't change the output, so they're normalized away first.
+// Programs with a random offset get a key too, but they're never stored (see compileFile).
+static void cacheKey(const Source *src, const Options *opts, char key[33]) {
+	Hash128 h = {0xcbf29ce484222325ull, 0x84222325cbf29ce4ull};
+	unsigned char flags = CACHE_VERSION << 4 | opts->comments << 3 | opts->var_table << 2 | opts->decimal_instr << 1 | opts->vars;
+	hashByte(&h, flags);
+	hashByte(&h, (unsigned char)(opts->format | opts->constant << 4 | (opts->registry != NULL) << 5 | opts->decoded << 6));
+
+	if (opts->comments) {
+		for (size_t i = 0; i < src->len; i++)
+			hashByte(&h, src->data[i]);
+	} else {
+		bool comment = false, space = false, empty = true;
+		for (size_t i = 0; i < src->len; i++) {
+			char c = src->data[i];
+			if (c == '\n') {
+				if (!empty)
+					hashByte(&h, '\n');
+				comment = space = false;
+				empty = true;
+			} else if (comment) {
+				continue;
+			} else if (c == ';') {
+				comment = true;
+			} else if (c == ' ' || c == ',' || c == '\t' || c == '\r') {
+				space = true; // at the start of a line too: directives and the header must be at column 0
+			} else {
+				if (space)
+					hashByte(&h, ' ');
+				hashByte(&h, c);
+				space = empty = false;
+			}
+		}
+	}
+
+	snprintf(key, 33, "%016llx%016llx", (unsigned long long)mix64(h.a), (unsigned long long)mix64(h.b ^ h.a));
+}
+
+// Outputs are written to a temporary file next to the target and renamed over it by closeOutput(),
+// so whatever includes the .c never sees half of it. The target is out_path, or the file it links to.
+// Anything that isn't a regular file (/dev/null, a FIFO, a dangling link) is written in place and tmp
+// is left empty. Without out_path this is just stdout.
+// binary only matters on Windows, where text files get \r\n line ends.
+static FILE *openOutput(const char *out_path, char *tmp, char *target, size_t size, bool binary) {
+	tmp[0] = '\0';
+	if (!out_path)
+		return stdout;
+#ifndef _WIN32
+	struct stat st;
+	snprintf(target, size, "%s", out_path);
+	if (lstat(out_path, &st) == 0 && S_ISLNK(st.st_mode) && (!realpath(out_path, target) || stat(target, &st) != 0))
+		return fopen(out_path, "w"); // dangling
+	bool exists = stat(target, &st) == 0;
+	if (exists && !S_ISREG(st.st_mode))
+		return fopen(target, "w");
+
+	size_t n = strlen(target);
+	if (n + sizeof(".XXXXXX") > size) {
+		errno = ENAMETOOLONG;
+		return NULL;
+	}
+	memcpy(tmp, target, n);
+	memcpy(tmp + n, ".XXXXXX", sizeof(".XXXXXX"));
+	int fd = mkstemp(tmp);
+	if (fd == -1)
+		return NULL;
+	fchmod(fd, exists ? st.st_mode & 07777 : 0644); // mkstemp creates it with 0600
+	(void)binary;
+	FILE *f = fdopen(fd, "w");
+	if (!f) {
+		close(fd);
+		unlink(tmp);
+	}
+	return f;
+#else
+	snprintf(target, size, "%s", out_path);
+	return fopen(out_path, binary ? "wb" : "w");
+#endif
+}
+
+// Returns 0 (with errno set) if writing failed, in which case a renamed target is left as it was
+static int closeOutput(FILE *f, const char *tmp, const char *target) {
+	if (f == stdout)
+		return fflush(f) == 0;
+	int ok = !ferror(f);
+	if (fclose(f) != 0)
+		ok = 0;
+	if (!tmp[0])
+		return ok;
+#ifndef _WIN32
+	if (ok && rename(tmp, target) != 0)
+		ok = 0;
+	if (!ok) {
+		int err = errno;
+		unlink(tmp);
+		errno = err;
+	}
+#else
+	(void)target;
+#endif
+	return ok;
+}
+
+// Whether the file at path holds exactly out
+static bool sameContents(const char *path, const OutBuf *out) {
+	FILE *f = fopen(path, "rb");
+	if (!f)
+		return false;
+	char buf[1 << 14];
+	size_t n, pos = 0;
+	bool same = true;
+	while (same && (n = fread(buf, 1, sizeof(buf), f)) > 0) {
+		same = n <= out->len - pos && memcmp(buf, out->data + pos, n) == 0;
+		pos += n;
+	}
+	same = same && !ferror(f) && pos == out->len;
+	fclose(f);
+	return same;
+}
+
+// Writes out to path (stdout if NULL) through a temporary file. A file that already holds the same
+// bytes isn't touched, so it keeps its mtime and make doesn't rebuild what depends on it.
+static int writeWhole(const char *path, const OutBuf *out, bool binary) {
+#ifndef _WIN32
+	struct stat st;
+	if (path && stat(path, &st) == 0 && S_ISREG(st.st_mode) && sameContents(path, out)) // reading a FIFO would block
+		return 1;
+#else
+	if (path && sameContents(path, out))
+		return 1;
+#endif
+	char tmp[PATH_MAX + 8], target[PATH_MAX + 8]; // realpath() fills up to PATH_MAX
+	FILE *f = openOutput(path, tmp, target, sizeof(tmp), binary);
+	if (f)
+		fwrite(out->data, 1, out->len, f); // errors are picked up by closeOutput()
+	if (!f || !closeOutput(f, tmp, target)) {
+		fprintf(stderr, "%s: %s\n", path ? path : "stdout", strerror(errno));
+		return 0;
+	}
+	return 1;
+}
+
+// Reads a cached output into out. Returns 0 on a miss.
+static int cacheFetch(const char *dir, const char *key, OutBuf *out) {
+#ifndef _WIN32
+	char path[4096];
+	snprintf(path, sizeof(path), "%s/%s.c", dir, key);
+	FILE *f = fopen(path, "r");
+	if (!f)
+		return 0;
+
+	size_t n;
+	out->len = 0;
+	do {
+		if (!reserve(&out->data, &out->cap, out->len + (1 << 14), 1)) {
+			fclose(f);
+			return 0;
+		}
+		n = fread(out->data + out->len, 1, out->cap - out->len, f);
+		out->len += n;
+	} while (n > 0);
+	int ok = !ferror(f);
+	fclose(f);
+	if (ok)
+		utime(path, NULL); // eviction drops the least recently used entries
+	return ok;
+#else
+	(void)dir;
+	(void)key;
+	(void)out;
+	return 0;
+#endif
+}
+
+// Writes the output into the cache. The entry is written to a temporary file and renamed, so
+// concurrent assemblers never see half of it.
+static void cacheStore(const char *dir, const char *key, const OutBuf *out) {
+#ifndef _WIN32
+	char tmp[4096], path[4096];
+	snprintf(tmp, sizeof(tmp), "%s/tmp.XXXXXX", dir);
+	snprintf(path, sizeof(path), "%s/%s.c", dir, key);
+
+	int fd = mkstemp(tmp);
+	if (fd == -1)
+		return; // the cache is only an optimization
+	FILE *f = fdopen(fd, "w");
+	if (!f) {
+		close(fd);
+		unlink(tmp);
+		return;
+	}
+	fwrite(out->data, 1, out->len, f);
+	if (ferror(f) | (fclose(f) != 0) || rename(tmp, path) != 0) {
+		unlink(tmp);
+		return;
+	}
+	cache_stats.stored++;
+#else
+	(void)dir;
+	(void)key;
+	(void)out;
+#endif
+}
+
+#ifndef _WIN32
+typedef struct {
+	char *name;
+	time_t mtime;
+	off_t size;
+} CacheEntry;
+
+static int compareCacheEntries(const void *a, const void *b) {
+	const CacheEntry *x = a, *y = b;
+	return (x->mtime > y->mtime) - (x->mtime < y->mtime);
+}
+#endif
+
+// Deletes the least recently used entries until the cache is at most max_size bytes
+int cacheEvict(const char *dir, uint64_t max_size) {
+#ifndef _WIN32
+	DIR *d = opendir(dir);
+	if (!d)
+		return 0;
+
+	CacheEntry *entries = NULL;
+	size_t count = 0, cap = 0;
+	uint64_t total = 0;
+	char path[4096];
+	struct dirent *e;
+	while ((e = readdir(d))) {
+		size_t len = strlen(e->d_name);
+		struct stat st;
+		if (len != 34 || strcmp(e->d_name + 32, ".c") != 0)
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", dir, e->d_name);
+		if (stat(path, &st) != 0)
+			continue;
+		if (!reserve(&entries, &cap, count + 1, sizeof(*entries)) || !(entries[count].name = strdup(e->d_name)))
+			break;
+		entries[count].mtime = st.st_mtime;
+		entries[count].size = st.st_size;
+		total += st.st_size;
+		count++;
+	}
+	closedir(d);
+
+	if (total > max_size) {
+		qsort(entries, count, sizeof(*entries), compareCacheEntries);
+		for (size_t i = 0; i < count && total > max_size; i++) {
+			snprintf(path, sizeof(path), "%s/%s", dir, entries[i].name);
+			if (unlink(path) == 0) {
+				total -= entries[i].size;
+				cache_stats.evicted++;
+			}
+		}
+	}
+
+	for (size_t i = 0; i < count; i++)
+		free(entries[i].name);
+	free(entries);
+	return 1;
+#else
+	(void)dir;
+	(void)max_size;
+	return 0;
+#endif
+}
+
+// The same path with .asm replaced by ext (malloc-ed)
+static char *replaceExtension(const char *path, const char *ext) {
+	size_t len = strlen(path), size;
+	if (len > 4 && strcmp(path + len - 4, ".asm") == 0)
+		len -= 4;
+	size = len + strlen(ext) + 1;
+	char *ret = malloc(size);
+	if (ret)
+		snprintf(ret, size, "%.*s%s", (int)len, path, ext);
+	return ret;
+}
+
+static void printError(const char *label, const bas_error *err, const char *src) {
+	char msg[256];
+	bas_format_error(err, src, msg, sizeof(msg));
+	if (err->line)
+		fprintf(stderr, "%s%sError on line %zu: %s\n", label ? label : "", label ? ": " : "", err->line, msg);
+	else
+		fprintf(stderr, "%s%s%s\n", label ? label : "", label ? ": " : "", msg);
+}
+
+// Assembles one input and writes the C code to out_path (stdout if NULL). The output is only opened
+// once the input assembled, so a failed bot keeps its previous output, and an unchanged one isn't
+// rewritten. in_path is the input's path (NULL for stdin), which -map writes the source map next to.
+// Errors are prefixed with label (if not NULL). If ret isn't NULL it gets the result (it's left
+// zeroed on a cache hit). With -bundle nothing is written and the caller takes the image from ret.
+int compileFile(bas_ctx *ctx, OutBuf *out, FILE *fin, const char *in_path, const char *out_path, const char *label, Options *opts, bas_result *ret) {
+	if (!fin)
+		return 0;
+
+	Source src;
+	if (!openSource(fin, &src))
+		return 0;
+
+	int ok = 1;
+	char key[33];
+	if (ret)
+		memset(ret, 0, sizeof(*ret));
+
+	if (opts->check) {
+		const bas_error *errors;
+		size_t n = bas_check(ctx, src.data, src.len, &errors);
+		for (size_t i = 0; i < n; i++)
+			printError(label, &errors[i], src.data);
+		ok = n == 0;
+		goto cleanup;
+	}
+	bool cached = opts->cache_dir && !opts->registry && !opts->bundle && !opts->map; // a hit has no result
+	if (cached) {
+		cacheKey(&src, opts, key);
+		if (cacheFetch(opts->cache_dir, key, out)) {
+			cache_stats.hits++;
+			ok = writeWhole(out_path, out, true); // copied byte for byte
+			goto cleanup;
+		}
+		cache_stats.misses++;
+	}
+
+	bas_result res;
+	if (!bas_assemble(ctx, src.data, src.len, NULL, 0, &res)) {
+		printError(label, &res.error, src.data);
+		ok = 0;
+		goto cleanup;
+	}
+
+	if (ret)
+		*ret = res;
+	if (opts->map) { // written first, as out is reused for the output
+		char *map_path = replaceExtension(in_path, ".map");
+		if (!map_path || !writeMap(out, ctx, &res, &src, in_path)) {
+			fprintf(stderr, "%s%sOut of memory\n", label ? label : "", label ? ": " : "");
+			ok = 0;
+		} else
+			ok = writeWhole(map_path, out, true);
+		free(map_path);
+		if (!ok)
+			goto cleanup;
+	}
+	if (opts->bundle) // the caller copies the image into the bundle
+		goto cleanup;
+
+	if (!writeOutput(out, ctx, &res, &src, opts)) {
+		fprintf(stderr, "%s%sOut of memory\n", label ? label : "", label ? ": " : "");
+		ok = 0;
+		goto cleanup;
+	}
+
+	ok = writeWhole(out_path, out, opts->format != FORMAT_C);
+	if (ok && cached && !res.random_offset) // the offset is drawn again on every build
+		cacheStore(opts->cache_dir, key, out);
+
+cleanup:
+	closeSource(&src);
+	return ok;
+}
+
+// The same path with .asm replaced by the extension of the format (malloc-ed)
+static char *outputPath(const char *path, const Options *opts) {
+	return replaceExtension(path, format_extensions[opts->format]);
+}
+
+// Assembles path into the same path with .asm replaced by .c
+static int compileBatchFile(bas_ctx *ctx, OutBuf *out, const char *path, Options *opts, bas_result *ret) {
+	FILE *fin = fopen(path, "r");
+	if (!fin) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return 0;
+	}
+
+	char *out_path = outputPath(path, opts);
+	if (!out_path) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		fclose(fin);
+		return 0;
+	}
+
+	int ok = compileFile(ctx, out, fin, path, out_path, path, opts, ret);
+	fclose(fin);
+
+	free(out_path);
+	return ok;
+}
+
+static double nowMicros(void) {
+	struct timespec ts;
+	timespec_get(&ts, TIME_UTC);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+// Assembles path into path.c (or the -o path) and again every time it's saved, until interrupted. The context
+// remembers how every line was encoded, so a rebuild only encodes the lines that changed.
+int watchFile(const char *path, Options *opts) {
+#ifdef __linux__
+	bas_ctx *ctx = bas_new(&(bas_options){.vars = opts->vars, .seed = (uint32_t)time(0), .incremental = true});
+	OutBuf out = {0};
+	char *out_path = opts->output ? strdup(opts->output) : outputPath(path, opts);
+	if (!ctx || !out_path) {
+		perror("watch");
+		goto fail;
+	}
+
+	// Editors often save by writing a new file and renaming it over the old one, which a watch on
+	// the file itself would lose, so the directory is watched instead
+	const char *slash = strrchr(path, '/');
+	const char *name = slash ? slash + 1 : path;
+	char dir[4096];
+	snprintf(dir, sizeof(dir), "%.*s", slash ? (int)(slash - path) + 1 : 1, slash ? path : ".");
+
+	int fd = inotify_init1(IN_CLOEXEC);
+	if (fd == -1 || inotify_add_watch(fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) == -1) {
+		fprintf(stderr, "%s: %s\n", dir, strerror(errno));
+		goto fail;
+	}
+
+	fprintf(stderr, "Watching %s (Ctrl+C to stop)\n", path);
+	for (bool changed = true;;) {
+		if (changed) {
+			double start = nowMicros();
+			FILE *fin = fopen(path, "r");
+			bas_result res;
+			size_t hits = cache_stats.hits;
+			if (!fin)
+				fprintf(stderr, "%s: %s\n", path, strerror(errno));
+			else if (compileFile(ctx, &out, fin, path, out_path, path, opts, &res)) {
+				if (opts->check) // nothing was assembled
+					fprintf(stderr, "%s: no errors in %.0f us\n", path, nowMicros() - start);
+				else if (cache_stats.hits != hits) // res is empty
+					fprintf(stderr, "%s: copied from the cache in %.0f us\n", out_path, nowMicros() - start);
+				else
+					fprintf(stderr, "%s: %zu instructions (%zu reused) in %.0f us\n", out_path, res.size, res.reused, nowMicros() - start);
+			}
+			if (fin)
+				fclose(fin);
+			changed = false;
+		}
+
+		char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+		ssize_t n = read(fd, buf, sizeof(buf));
+		if (n <= 0) {
+			if (n == -1 && errno == EINTR)
+				continue;
+			perror("read");
+			break;
+		}
+		for (char *p = buf; p < buf + n;) {
+			const struct inotify_event *ev = (const struct inotify_event *)p;
+			if (ev->len && strcmp(ev->name, name) == 0)
+				changed = true;
+			p += sizeof(*ev) + ev->len;
+		}
+	}
+	close(fd);
+
+fail:
+	free(out.data);
+	free(out_path);
+	bas_free(ctx);
+	return 0;
+#else
+	(void)path;
+	(void)opts;
+	fprintf(stderr, "-watch needs inotify (Linux only)\n");
+	return 0;
+#endif
+}
+
+// Finds the first "<name><suffix>" in s and copies the name. Returns the end of the match, NULL if there's none.
+static const char *findCSymbol(const char *s, const char *end, const char *suffix, char *name) {
+	size_t len = strlen(suffix);
+	for (const char *p = s; p + len <= end; p++)
+		if (memcmp(p, suffix, len) == 0) {
+			const char *n = p;
+			while (n > s && (isalnum((unsigned char)n[-1]) || n[-1] == '_'))
+				n--;
+			snprintf(name, 255, "%.*s", (int)(p - n), n);
+			return p + len;
+		}
+	return NULL;
+}
+
+// Reads the numbers of a -format=c array up to its closing brace. Returns where it stopped, NULL if
+// out of memory.
+static const char *parseCWords(const char *p, const char *end, uint16_t **code, size_t *count) {
+	size_t cap = 0;
+	while (p < end && *p != '{')
+		p++;
+	for (p++; p < end && *p != '}';) {
+		if (*p == '/' && p + 1 < end && p[1] == '/') { // the source line
+			while (p < end && *p != '\n')
+				p++;
+		} else if (isdigit((unsigned char)*p)) {
+			int base = 10;
+			if (p + 1 < end && (p[1] == 'b' || p[1] == 'x')) {
+				base = p[1] == 'b' ? 2 : 16;
+				p += 2;
+			}
+			unsigned long v = 0;
+			for (; p < end && isxdigit((unsigned char)*p); p++)
+				v = v * base + (isdigit((unsigned char)*p) ? *p - '0' : (*p | 0x20) - 'a' + 10);
+			if (!reserve(code, &cap, *count + 1, sizeof(**code)))
+				return NULL;
+			(*code)[(*count)++] = (uint16_t)v;
+		} else
+			p++;
+	}
+	return p;
+}
+
+// The same for the string literals of a -format=cstring blob: two bytes per word, low byte first.
+// Only the escapes putStringByte() writes are understood (octal, \\, \" and \?).
+static const char *parseCStringWords(const char *p, const char *end, uint16_t **code, size_t *count) {
+	size_t cap = 0, bytes = 0;
+	while (p < end && *p != '}') {
+		if (*p == '/' && p + 1 < end && p[1] == '/') { // the source line
+			while (p < end && *p != '\n')
+				p++;
+			continue;
+		}
+		if (*p++ != '"')
+			continue;
+		while (p < end && *p != '"') {
+			unsigned c = (unsigned char)*p++;
+			if (c == '\\' && p < end) {
+				if (inside('0', *p, '7')) {
+					c = 0;
+					for (int i = 0; i < 3 && p < end && inside('0', *p, '7'); i++)
+						c = c * 8 + (*p++ - '0');
+				} else {
+					c = (unsigned char)*p++;
+				}
+			}
+			if (bytes++ % 2) {
+				(*code)[*count - 1] |= (uint16_t)((c & 0xFF) << 8);
+			} else {
+				if (!reserve(code, &cap, *count + 1, sizeof(**code)))
+					return NULL;
+				(*code)[(*count)++] = (uint16_t)(c & 0xFF);
+			}
+		}
+		p++; // the closing quote
+	}
+	return p;
+}
+
+// Reads the image from our own C output (-format=c or cstring, -const or not): the words in
+// <name>_mem or <name>_blob and the number in <name>_offset
+static int parseCImage(const Source *src, char *name, int *offset, uint16_t **code, size_t *count) {
+	const char *s = src->data, *end = s + src->len;
+	*code = NULL;
+	*count = 0;
+	const char *p;
+	if ((p = findCSymbol(s, end, "_mem[] =", name)))
+		p = parseCWords(p, end, code, count);
+	else if ((p = findCSymbol(s, end, "_blob = {", name)))
+		p = parseCStringWords(p, end, code, count);
+	if (!p)
+		return 0;
+
+	*offset = 0;
+	char key[300];
+	int key_len = snprintf(key, sizeof(key), "%s_offset = ", name);
+	for (const char *q = p; q + key_len <= end; q++)
+		if (memcmp(q, key, key_len) == 0) {
+			*offset = (int)strtol(q + key_len, NULL, 10); // the line ends with ';', so strtol stops in the buffer
+			break;
+		}
+	return 1;
+}
+
+static uint32_t get32(const unsigned char *p) {
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+// Reads a -format=bin image. Returns 0 if it isn't one (no magic), -1 if it's one but broken.
+static int parseBinImage(const Source *src, char *name, int *offset, uint16_t **code, size_t *count) {
+	const unsigned char *p = (const unsigned char *)src->data;
+	if (src->len < sizeof(bas_bin_header) || memcmp(p, BAS_BIN_MAGIC, 4) != 0)
+		return 0;
+	*count = get32(p + offsetof(bas_bin_header, size));
+	if ((p[offsetof(bas_bin_header, version)] | p[offsetof(bas_bin_header, version) + 1] << 8) != BAS_BIN_VERSION ||
+		(src->len - sizeof(bas_bin_header)) / 2 < *count)
+		return -1;
+	*offset = (int32_t)get32(p + offsetof(bas_bin_header, offset));
+	snprintf(name, 255, "%.*s", (int)strnlen((const char *)p + offsetof(bas_bin_header, name), 254), p + offsetof(bas_bin_header, name));
+	if (*count && !(*code = malloc(*count * sizeof(**code))))
+		return -1;
+	p += sizeof(bas_bin_header);
+	for (size_t i = 0; i < *count; i++)
+		(*code)[i] = p[2 * i] | p[2 * i + 1] << 8;
+	return 1;
+}
+
+// Writes the source of every bot in a -bundle file, in index order and separated by blank lines.
+// The bots are used straight from the mapped file.
+static int disassembleBundle(const char *path, const Source *src) {
+	bas_bundle bundle;
+	if (!bas_bundle_open(&bundle, src->data, src->len)) {
+		fprintf(stderr, "%s: broken bundle (unknown version or truncated)\n", path);
+		return 0;
+	}
+	char *buf = NULL;
+	size_t cap = 0;
+	for (size_t i = 0; i < bundle.count; i++) {
+		bas_bundle_bot bot;
+		bas_bundle_get(&bundle, i, &bot);
+		if (!reserve(&buf, &cap, BAS_DISASM_CAP(bot.size), 1)) {
+			perror("malloc");
+			free(buf);
+			return 0;
+		}
+		size_t n = bas_disassemble(bot.name, bot.offset, bot.code, bot.size, buf, cap);
+		if ((i && putchar('\n') == EOF) || fwrite(buf, 1, n, stdout) != n) {
+			free(buf);
+			return 0;
+		}
+	}
+	free(buf);
+	return 1;
+}
+
+// Turns an image back into source on stdout. .c files are read as our C output, -format=bin images
+// and -bundle files are recognized by their header and anything else is read as raw little endian
+// words (named after the file, offset 0).
+int disassembleFile(const char *path) {
+	bool stdin_input = strcmp(path, "-") == 0;
+	FILE *fin = stdin_input ? stdin : fopen(path, "rb");
+	if (!fin) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return 0;
+	}
+#ifdef _WIN32
+	if (stdin_input)
+		_setmode(_fileno(stdin), _O_BINARY);
+#endif
+	Source src;
+	int ok = openSource(fin, &src);
+	if (!stdin_input)
+		fclose(fin);
+	if (!ok)
+		return 0;
+
+	char name[255];
+	int offset = 0;
+	uint16_t *code = NULL;
+	size_t count = 0, len = strlen(path);
+	if (len > 2 && strcmp(path + len - 2, ".c") == 0) {
+		if (!parseCImage(&src, name, &offset, &code, &count)) {
+			fprintf(stderr, "%s: no <name>_mem array or <name>_blob string found\n", path);
+			ok = 0;
+			goto cleanup;
+		}
+	} else if (src.len >= 4 && memcmp(src.data, BAS_BUNDLE_MAGIC, 4) == 0) {
+		ok = disassembleBundle(path, &src);
+		goto cleanup;
+	} else if ((ok = parseBinImage(&src, name, &offset, &code, &count)) != 0) {
+		if (ok == -1) {
+			fprintf(stderr, "%s: broken image (unknown version, truncated or out of memory)\n", path);
+			ok = 0;
+			goto cleanup;
+		}
+	} else {
+		ok = 1;
+		if (src.len % 2) {
+			fprintf(stderr, "%s: odd size, not an image of 16 bit words\n", path);
+			ok = 0;
+			goto cleanup;
+		}
+		const char *base = strrchr(path, '/');
+		base = stdin_input ? "image" : base ? base + 1 : path;
+		snprintf(name, sizeof(name), "%.*s", (int)strcspn(base, ". \t"), base);
+		if (!name[0])
+			strcpy(name, "image");
+		count = src.len / 2;
+		if (count && !(code = malloc(count * sizeof(*code)))) {
+			perror("malloc");
+			ok = 0;
+			goto cleanup;
+		}
+		for (size_t i = 0; i < count; i++)
+			code[i] = (unsigned char)src.data[2 * i] | (unsigned char)src.data[2 * i + 1] << 8;
+	}
+
+	size_t cap = BAS_DISASM_CAP(count);
+	char *buf = malloc(cap);
+	if (!buf) {
+		perror("malloc");
+		ok = 0;
+		goto cleanup;
+	}
+	size_t n = bas_disassemble(name, offset, code, count, buf, cap);
+	if (fwrite(buf, 1, n, stdout) != n)
+		ok = 0;
+	free(buf);
+
+cleanup:
+	free(code);
+	closeSource(&src);
+	return ok;
+}
+
+static void *batchWorker(void *arg) {
+	Batch *b = arg;
+	bas_ctx *ctx = bas_new(&(bas_options){.vars = b->opts->vars, .seed = (uint32_t)time(0) ^ (uint32_t)(uintptr_t)&ctx});
+	if (!ctx) {
+		perror("bas_new");
+		return NULL;
+	}
+	OutBuf out = {0};
+
+	size_t i;
+	bas_result res;
+	while ((i = b->next++) < b->count) {
+		if (!compileBatchFile(ctx, &out, b->paths[i], b->opts, &res))
+			b->failed++;
+		else if (b->entries) {
+			RegistryEntry *e = &b->entries[i];
+			memcpy(e->name, res.name, sizeof(res.name));
+			e->size = res.size;
+			e->offset = res.offset;
+			e->random_offset = res.random_offset;
+			if (b->opts->bundle && res.size) { // res.code is only valid until the next program
+				if (!(e->code = malloc(res.size * sizeof(*e->code)))) {
+					fprintf(stderr, "%s: Out of memory\n", b->paths[i]);
+					b->failed++;
+					continue;
+				}
+				memcpy(e->code, res.code, res.size * sizeof(*e->code));
+			}
+		}
+	}
+
+	free(out.data);
+	freeContext(ctx);
+	return NULL;
+}
+
+static int comparePaths(const void *a, const void *b) {
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// Adds inputs[i] (or the .asm files in it, if it's a directory) to the batch
+static int addBatchInput(Batch *b, size_t *cap, const char *input) {
+#ifndef _WIN32
+	struct stat st;
+	if (stat(input, &st) == 0 && S_ISDIR(st.st_mode)) {
+		DIR *dir = opendir(input);
+		if (!dir) {
+			fprintf(stderr, "%s: %s\n", input, strerror(errno));
+			return 0;
+		}
+		struct dirent *e;
+		while ((e = readdir(dir))) {
+			size_t len = strlen(e->d_name);
+			if (len <= 4 || strcmp(e->d_name + len - 4, ".asm") != 0)
+				continue;
+			char *path = malloc(strlen(input) + len + 2);
+			if (!path || !reserve(&b->paths, cap, b->count + 1, sizeof(*b->paths))) {
+				perror("malloc");
+				free(path);
+				closedir(dir);
+				return 0;
+			}
+			sprintf(path, "%s/%s", input, e->d_name);
+			b->paths[b->count++] = path;
+		}
+		closedir(dir);
+		return 1;
+	}
+#endif
+	char *path = strdup(input);
+	if (!path || !reserve(&b->paths, cap, b->count + 1, sizeof(*b->paths))) {
+		perror("malloc");
+		free(path);
+		return 0;
+	}
+	b->paths[b->count++] = path;
+	return 1;
+}
+
+static int compareEntries(const void *a, const void *b) {
+	return strcmp(((const RegistryEntry *)a)->name, ((const RegistryEntry *)b)->name);
+}
+
+static int findDuplicate(const char *path, const RegistryEntry *entries, size_t count) {
+	for (size_t i = 1; i < count; i++)
+		if (strcmp(entries[i - 1].name, entries[i].name) == 0) {
+			fprintf(stderr, "%s: two bots are called %s\n", path, entries[i].name);
+			return 1;
+		}
+	return 0;
+}
+
+// Writes the -registry file: a table of every bot, sorted by name, which refers to the images in the
+// bots' own outputs, so a changed bot only means compiling it and this file again. It isn't written
+// if a bot failed, so it always matches the outputs that are there.
+static int writeRegistry(const char *path, RegistryEntry *entries, size_t count, const Options *opts) {
+	if (count)
+		qsort(entries, count, sizeof(*entries), compareEntries);
+	if (findDuplicate(path, entries, count))
+		return 0;
+
+	OutBuf out = {0};
+	int ok = outPrintf(&out, "// Generated by the assembler: every bot, sorted by name\n"
+							 "#include <stddef.h>\n"
+							 "#include <stdint.h>\n");
+	if (opts->decoded)
+		ok = ok && writeDecodedType(&out);
+	ok = ok && outPrintf(&out, "\n"
+							   "typedef struct {\n"
+							   "\tconst char *name;\n"
+							   "\tconst uint16_t *mem;\n"
+							   "\tuint16_t size, offset;\n"
+							   "%s"
+							   "} bot_descriptor;\n"
+							   "\n",
+						 opts->decoded ? "\tconst bot_decoded *decoded;\n" : "");
+	for (size_t i = 0; ok && i < count; i++) {
+		if (opts->format == FORMAT_CSTRING) // the type must match the definition in the bot's file
+			ok = outPrintf(&out, "extern const union {\n\tchar s[%zu];\n\tuint16_t w[%zu];\n} %s_blob;\n",
+						   2 * entries[i].size, entries[i].size, entries[i].name);
+		else
+			ok = outPrintf(&out, "extern const uint16_t %s_mem[];\n", entries[i].name);
+		if (ok && opts->decoded)
+			ok = outPrintf(&out, "extern const bot_decoded %s_decoded[];\n", entries[i].name);
+	}
+	ok = ok && outPrintf(&out, "\nconst bot_descriptor bots[] = {\n");
+	for (size_t i = 0; ok && i < count; i++) {
+		ok = outPrintf(&out, "\t{\"%s\", %s%s, %zu, %d", entries[i].name, entries[i].name,
+					   opts->format == FORMAT_CSTRING ? "_blob.w" : "_mem", entries[i].size, entries[i].offset);
+		if (ok && opts->decoded)
+			ok = outPrintf(&out, ", %s_decoded", entries[i].name);
+		ok = ok && outPrintf(&out, "},\n");
+	}
+	if (count == 0)
+		ok = ok && outPrintf(&out, "\t{0}, // no bots, but C doesn't allow empty arrays\n");
+	ok = ok && outPrintf(&out, "};\nconst size_t bots_count = %zu;\n", count);
+	if (!ok)
+		fprintf(stderr, "%s: Out of memory\n", path);
+	else
+		ok = writeWhole(path, &out, false);
+	free(out.data);
+	return ok;
+}
+
+// Orders entries like the bundle index (by bas_bundle_hash, then by name), hashing every name once
+typedef struct {
+	uint32_t hash;
+	RegistryEntry *e;
+} BundleKey;
+
+static int compareBundleKeys(const void *a, const void *b) {
+	const BundleKey *x = a, *y = b;
+	if (x->hash != y->hash)
+		return x->hash < y->hash ? -1 : 1;
+	return strcmp(x->e->name, y->e->name);
+}
+
+#define ALIGN_BUNDLE(n) (((n) + BAS_BUNDLE_ALIGN - 1) & ~(size_t)(BAS_BUNDLE_ALIGN - 1))
+
+// Writes the -bundle file (see bas_bundle_header): the index, the names and every image at a multiple
+// of BAS_BUNDLE_ALIGN. Like the registry, it isn't written if a bot failed.
+static int writeBundle(const char *path, RegistryEntry *entries, size_t count) {
+	if (count)
+		qsort(entries, count, sizeof(*entries), compareEntries);
+	if (findDuplicate(path, entries, count))
+		return 0;
+
+	size_t names = sizeof(bas_bundle_header) + count * sizeof(bas_bundle_entry), images = names;
+	for (size_t i = 0; i < count; i++)
+		images += strlen(entries[i].name) + 1;
+	images = ALIGN_BUNDLE(images);
+	if (images > UINT32_MAX) { // name offsets are 32 bit
+		fprintf(stderr, "%s: too many bots for one bundle\n", path);
+		return 0;
+	}
+
+	BundleKey *keys = malloc((count ? count : 1) * sizeof(*keys));
+	OutBuf out = {.len = images};
+	for (size_t i = 0; i < count; i++)
+		out.len += ALIGN_BUNDLE(2 * entries[i].size);
+	if (!keys || !reserve(&out.data, &out.cap, out.len, 1)) {
+		fprintf(stderr, "%s: Out of memory\n", path);
+		free(keys);
+		free(out.data);
+		return 0;
+	}
+	for (size_t i = 0; i < count; i++)
+		keys[i] = (BundleKey){bas_bundle_hash(entries[i].name), &entries[i]};
+	if (count)
+		qsort(keys, count, sizeof(*keys), compareBundleKeys);
+
+	unsigned char *p = (unsigned char *)out.data;
+	memset(p, 0, out.len);
+	memcpy(p + offsetof(bas_bundle_header, magic), BAS_BUNDLE_MAGIC, 4);
+	put16(p + offsetof(bas_bundle_header, version), BAS_BUNDLE_VERSION);
+	put32(p + offsetof(bas_bundle_header, count), (uint32_t)count);
+	put32(p + offsetof(bas_bundle_header, names), (uint32_t)names);
+	put64(p + offsetof(bas_bundle_header, size), out.len);
+	unsigned char *index = p + sizeof(bas_bundle_header);
+	for (size_t i = 0; i < count; i++, index += sizeof(bas_bundle_entry)) {
+		const RegistryEntry *e = keys[i].e;
+		size_t name_len = strlen(e->name) + 1;
+		put32(index + offsetof(bas_bundle_entry, hash), keys[i].hash);
+		put32(index + offsetof(bas_bundle_entry, name), (uint32_t)names);
+		put32(index + offsetof(bas_bundle_entry, size), (uint32_t)e->size);
+		put32(index + offsetof(bas_bundle_entry, offset), (uint32_t)e->offset);
+		put64(index + offsetof(bas_bundle_entry, image), images);
+		put32(index + offsetof(bas_bundle_entry, flags), e->random_offset ? BAS_BIN_RANDOM_OFFSET : 0);
+		memcpy(p + names, e->name, name_len);
+		names += name_len;
+		for (size_t j = 0; j < e->size; j++)
+			put16(p + images + 2 * j, e->code[j]);
+		images += ALIGN_BUNDLE(2 * e->size);
+	}
+	free(keys);
+
+	int ok = writeWhole(path, &out, true);
+	free(out.data);
+	return ok;
+}
+
+int compileBatch(char **inputs, size_t count, Options *opts, int jobs) {
+	Batch b = {.opts = opts};
+	size_t cap = 0;
+	int ok = 1;
+
+	for (size_t i = 0; i < count; i++) {
+		if (strcmp(inputs[i], "-") == 0) {
+			fprintf(stderr, "stdin can't be used together with other inputs\n");
+			ok = 0;
+			goto cleanup;
+		}
+		if (!addBatchInput(&b, &cap, inputs[i])) {
+			ok = 0;
+			goto cleanup;
+		}
+	}
+	if (b.count)
+		qsort(b.paths, b.count, sizeof(*b.paths), comparePaths);
+	if ((opts->registry || opts->bundle) && b.count && !(b.entries = calloc(b.count, sizeof(*b.entries)))) {
+		perror("malloc");
+		ok = 0;
+		goto cleanup;
+	}
+
+#ifndef _WIN32
+	if (jobs <= 0) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		jobs = cpus > 0 ? (int)cpus : 1;
+	}
+	if ((size_t)jobs > b.count)
+		jobs = b.count ? b.count : 1;
+
+	pthread_t *threads = malloc(jobs * sizeof(*threads));
+	if (!threads) {
+		perror("malloc");
+		ok = 0;
+		goto cleanup;
+	}
+	int started = 0;
+	for (; started < jobs; started++)
+		if (pthread_create(&threads[started], NULL, batchWorker, &b) != 0)
+			break;
+	if (started == 0)
+		batchWorker(&b); // no threads available, do it ourselves
+	for (int i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+#else
+	(void)jobs;
+	batchWorker(&b);
+#endif
+
+	size_t failed = b.failed, done = b.next < b.count ? b.next : b.count;
+	if (done < b.count) // a worker couldn't even start
+		failed += b.count - done;
+	if (failed) {
+		fprintf(stderr, "%zu of %zu files failed\n", failed, b.count);
+		ok = 0;
+	} else if (opts->check)
+		; // nothing was assembled
+	else if (opts->registry && !writeRegistry(opts->registry, b.entries, b.count, opts))
+		ok = 0;
+	else if (opts->bundle && !writeBundle(opts->bundle, b.entries, b.count))
+		ok = 0;
+
+cleanup:
+	for (size_t i = 0; i < b.count; i++) {
+		free(b.paths[i]);
+		if (b.entries)
+			free(b.entries[i].code);
+	}
+	free(b.paths);
+	free(b.entries);
+	return ok;
+}
+
+// Server mode protocol (all integers little endian):
+//   request:  u32 length, then length bytes of source (header line included)
+//   response: u32 status (0 assembled, 1 error), u32 size, i32 offset, u32 flags (BAS_BIN_RANDOM_OFFSET),
+//             the error as u32 code, line, start and len (bas_error, all 0 if assembled),
+//             u32 text length and the text (program name or error message),
+//             then size u16 instructions if the status is 0
+// The request and response buffers and the context are reused, so a steady stream of requests
+// doesn't allocate.
+#define SERVER_MAX_REQUEST (64u << 20)
+#define SERVER_HEADER 36 // response bytes before the text
+
+// Serves requests until in ends. Returns 0 on I/O or protocol errors.
+int serve(FILE *in, FILE *out, bas_ctx *ctx) {
+	char *req = NULL;
+	unsigned char *resp = NULL;
+	size_t req_cap = 0, resp_cap = 0;
+	int ok = 1;
+
+	unsigned char len_buf[4];
+	while (fread(len_buf, 1, 4, in) == 4) {
+		uint32_t len = len_buf[0] | len_buf[1] << 8 | len_buf[2] << 16 | (uint32_t)len_buf[3] << 24;
+		if (len > SERVER_MAX_REQUEST) {
+			fprintf(stderr, "Request too big (%u bytes)\n", len);
+			ok = 0;
+			break;
+		}
+		if (!reserve(&req, &req_cap, len ? len : 1, 1)) {
+			perror("realloc");
+			ok = 0;
+			break;
+		}
+		if (fread(req, 1, len, in) != len) {
+			fprintf(stderr, "Truncated request\n");
+			ok = 0;
+			break;
+		}
+
+		bas_result res;
+		int assembled = bas_assemble(ctx, req, len, NULL, 0, &res);
+		char msg[256];
+		if (!assembled)
+			bas_format_error(&res.error, req, msg, sizeof(msg));
+		const char *text = assembled ? res.name : msg;
+		size_t text_len = strlen(text);
+		size_t resp_len = SERVER_HEADER + text_len + (assembled ? 2 * res.size : 0);
+		if (!reserve(&resp, &resp_cap, resp_len, 1)) {
+			perror("realloc");
+			ok = 0;
+			break;
+		}
+
+		bas_error err = assembled ? (bas_error){0} : res.error;
+		put32(resp, !assembled);
+		put32(resp + 4, res.size);
+		put32(resp + 8, (uint32_t)res.offset);
+		put32(resp + 12, assembled && res.random_offset ? BAS_BIN_RANDOM_OFFSET : 0);
+		put32(resp + 16, err.code);
+		put32(resp + 20, err.line);
+		put32(resp + 24, err.start);
+		put32(resp + 28, err.len);
+		put32(resp + 32, text_len);
+		memcpy(resp + SERVER_HEADER, text, text_len);
+		unsigned char *p = resp + SERVER_HEADER + text_len;
+		for (size_t i = 0; assembled && i < res.size; i++) {
+			*p++ = res.code[i];
+			*p++ = res.code[i] >> 8;
+		}
+
+		if (fwrite(resp, 1, resp_len, out) != resp_len || fflush(out) != 0) {
+			perror("fwrite");
+			ok = 0;
+			break;
+		}
+	}
+	if (ferror(in)) {
+		perror("fread");
+		ok = 0;
+	}
+
+	free(req);
+	free(resp);
+	return ok;
+}
+
+// Listens on a Unix socket and serves one connection after another
+int serveSocket(const char *path, bas_ctx *ctx) {
+#ifndef _WIN32
+	struct sockaddr_un addr = {.sun_family = AF_UNIX};
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Socket path too long: %s\n", path);
+		return 0;
+	}
+	strcpy(addr.sun_path, path);
+
+	signal(SIGPIPE, SIG_IGN); // a client going away must not kill the server
+
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd == -1) {
+		perror("socket");
+		return 0;
+	}
+	unlink(path);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, 8) != 0) {
+		perror("bind");
+		close(fd);
+		return 0;
+	}
+
+	for (;;) {
+		int conn = accept(fd, NULL, NULL);
+		if (conn == -1) {
+			if (errno == EINTR)
+				continue;
+			perror("accept");
+			break;
+		}
+		int conn_out = dup(conn);
+		FILE *in = fdopen(conn, "rb");
+		FILE *out = conn_out != -1 ? fdopen(conn_out, "wb") : NULL;
+		if (in && out)
+			serve(in, out, ctx); // a broken connection only ends that client
+		else
+			perror("fdopen");
+		if (in)
+			fclose(in);
+		else
+			close(conn);
+		if (out)
+			fclose(out);
+		else if (conn_out != -1)
+			close(conn_out);
+	}
+
+	close(fd);
+	unlink(path);
+	return 0;
+#else
+	(void)path;
+	(void)ctx;
+	fprintf(stderr, "-socket isn't supported on Windows, use -server\n");
+	return 0;
+#endif
+}
+
+#endif
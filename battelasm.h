@@ -0,0 +1,242 @@
+/*
+Library interface of the BattelASM assembler. The implementation is assembler.c compiled with
+-DBAS_NO_MAIN (see README.md).
+
+All state lives in a bas_ctx, so separate contexts can be used from separate threads at the same time.
+The library does no I/O: sources are passed in memory and the result is a uint16_t image.
+*/
+
+#ifndef BATTELASM_H
+#define BATTELASM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct bas_ctx bas_ctx;
+
+typedef struct {
+	bool vars; // allow variables (aliases for free registers)
+	uint32_t seed; // seed for random offsets (header offset -1)
+	bool incremental; // remember line encodings so reassembling an edited program only encodes changed lines
+} bas_options;
+
+// Source line of an instruction
+typedef struct {
+	size_t line; // 1-based, 0 for the flag instructions #starts pads with
+	size_t start, len; // the whole line (without the newline) as an offset into the source
+} bas_line;
+
+// Error codes (bas_error.code)
+enum {
+	BAS_E_NONE,
+	BAS_E_NO_HEADER,
+	BAS_E_STARTS_PARAM, // #starts without a parameter
+	BAS_E_STARTS_BACK, // args: current instruction, wanted instruction
+	BAS_E_FREE_UNUSED, // #free of a variable that isn't in use
+	BAS_E_RANGE, // immediate out of range; args: bits, value
+	BAS_E_RANDOM_OFFSET, // program too big for offset -1; args: size
+	BAS_E_OUTPUT_SIZE, // out too small; args: size, cap
+	BAS_E_OUT_OF_MEMORY,
+	BAS_E_TOO_MANY_PARAMS, // args: expected
+	BAS_E_TOO_FEW_PARAMS, // args: expected
+	BAS_E_UNKNOWN_INSTRUCTION,
+	BAS_E_UNKNOWN_REGISTER,
+	BAS_E_VARIABLE_NAME, // starts with a digit or #
+	BAS_E_VARIABLES_OFF,
+	BAS_E_TOO_MANY_VARIABLES,
+	BAS_E_UNKNOWN_CONSTANT,
+	BAS_E_BINARY, // invalid number literals
+	BAS_E_HEX,
+	BAS_E_DECIMAL,
+};
+
+// Errors are kept as a code, the offending token and a couple of numbers. bas_format_error turns them
+// into text, so nothing is formatted unless it's printed.
+typedef struct {
+	int code;
+	size_t line; // 0 if the error isn't tied to a line
+	size_t start, len; // the token as an offset into the source (len 0 if there's none)
+	long long args[2];
+} bas_error;
+
+typedef struct {
+	char name[255];
+	int offset;
+	size_t size; // number of instructions
+	// Owned by the context and valid until its next bas_assemble call
+	const uint16_t *code;
+	const bas_line *lines;
+	size_t reused; // instructions taken from the previous run (incremental mode)
+	bool random_offset; // the header asked for a random offset (-1) and offset is the one picked
+
+	bas_error error; // set when bas_assemble fails
+} bas_result;
+
+// Layout of the files -format=bin writes: this header, then size uint16_t words. Everything is little
+// endian and the header is 272 bytes, so a mapped file can be used in place.
+#define BAS_BIN_MAGIC "BASM" // not null terminated in the file
+#define BAS_BIN_VERSION 1
+#define BAS_BIN_RANDOM_OFFSET 1 // flags: see bas_result.random_offset
+typedef struct {
+	char magic[4];
+	uint16_t version;
+	uint16_t flags;
+	uint32_t size; // number of instructions
+	int32_t offset;
+	char name[256]; // null terminated, zero padded
+} bas_bin_header;
+
+// Layout of the bundles -bundle writes: many images in one file, meant to be mapped and used in
+// place. The header, then count entries sorted by (hash, name), the null terminated names and the
+// images, each starting at a multiple of BAS_BUNDLE_ALIGN. All offsets are from the start of the
+// file and everything is little endian.
+#define BAS_BUNDLE_MAGIC "BASB" // not null terminated in the file
+#define BAS_BUNDLE_VERSION 1
+#define BAS_BUNDLE_ALIGN 64
+typedef struct {
+	char magic[4];
+	uint16_t version;
+	uint16_t flags; // 0
+	uint32_t count;
+	uint32_t names; // offset of the first name
+	uint64_t size; // of the whole file
+} bas_bundle_header;
+
+typedef struct {
+	uint32_t hash; // bas_bundle_hash of the name
+	uint32_t name; // offset of the name
+	uint32_t size; // number of instructions
+	int32_t offset;
+	uint64_t image; // offset of the words
+	uint32_t flags; // BAS_BIN_RANDOM_OFFSET
+	uint32_t reserved; // 0
+} bas_bundle_entry;
+
+// A bundle in memory (usually a mapped file), checked once by bas_bundle_open
+typedef struct {
+	const unsigned char *data;
+	size_t len;
+	size_t count;
+} bas_bundle;
+
+// One program in a bundle. name and code point into the bundle's memory, nothing is copied.
+typedef struct {
+	const char *name;
+	const uint16_t *code;
+	size_t size;
+	int offset;
+	bool random_offset;
+} bas_bundle_bot;
+
+// Layout of the source maps -map writes next to the input (bot.asm -> bot.map), little endian: this
+// header, count entries (entry i is instruction i, so a profiler can index it directly), the path of
+// the source (file bytes, not null terminated) and vars variable records. A record is a uint16_t
+// register and a uint16_t length, followed by that many bytes of the name as written.
+#define BAS_MAP_MAGIC "BMAP" // not null terminated in the file
+#define BAS_MAP_VERSION 1
+typedef struct {
+	char magic[4];
+	uint16_t version;
+	uint16_t file; // length of the source path
+	uint32_t count; // number of instructions
+	uint32_t vars; // variables bound at the end of the program
+} bas_map_header;
+
+typedef struct {
+	uint32_t line; // 1-based, 0 for the flag instructions #starts pads with
+	uint16_t column; // 1-based byte offset of the instruction in the line (0 with line 0)
+	uint16_t len; // length of the instruction, without the comment and trailing blanks
+} bas_map_entry;
+
+// Operand kinds
+enum {
+	BAS_NONE,
+	BAS_REG, // r0 - r31
+	BAS_IMM6,
+	BAS_IMM16,
+};
+
+#define BAS_HANDLERS 24 // number of operations
+
+// One decoded instruction word
+typedef struct {
+	const char *mnemonic; // lowercase
+	uint8_t opcode; // the top 6 bits (0 for ldi)
+	uint8_t handler; // the operations numbered densely from 0 (ldi) to BAS_HANDLERS - 1, for jump tables
+	uint8_t arity;
+	uint8_t kind[2];
+	// The 6 bit immediate of addi, subi, shli and shri includes bit 5, which is also bit 0 of the
+	// register: subi r1, 2 decodes as subi r1, 34 (the same word)
+	uint16_t operand[2];
+} bas_instr;
+
+// opts may be NULL for the defaults (variables on, seed 0). Returns NULL if out of memory.
+bas_ctx *bas_new(const bas_options *opts);
+void bas_free(bas_ctx *ctx);
+
+// Assembles one program (header line included). If out isn't NULL, the image is also copied there and
+// it's an error if it has less than res->size elements. Returns 1 on success and 0 on error.
+int bas_assemble(bas_ctx *ctx, const char *src, size_t len, uint16_t *out, size_t cap, bas_result *res);
+
+// Allocation counters of a context since bas_new. Everything a program needs is taken from an arena
+// that's emptied when the next one starts, so after the first few programs mallocs stays put.
+typedef struct {
+	size_t programs; // bas_assemble and bas_check calls
+	size_t allocs; // arrays taken from the arena (growing in place doesn't count)
+	size_t mallocs, frees; // calls to the system allocator (the context itself included)
+	size_t bytes; // size of the arena
+} bas_stats;
+
+void bas_get_stats(const bas_ctx *ctx, bas_stats *stats);
+
+// Decodes one word. Every word decodes to something that assembles back into it: words that aren't a
+// valid instruction (unused opcode or nonzero unused bits) decode as ldi with the word itself.
+void bas_decode(uint16_t word, bas_instr *out);
+
+// Longest line bas_disassemble writes ("addi r29, 63\n" or "ldi 0xffff\n") and the size of its
+// buffer for count instructions, header line and null terminator included
+#define BAS_DISASM_LINE 16
+#define BAS_DISASM_CAP(count) (256 + 16 + BAS_DISASM_LINE * (size_t)(count))
+
+// Writes the source of an image: the header line "name offset" and one instruction per line.
+// Assembling it gives back the same image. buf must have room for BAS_DISASM_CAP(count) bytes.
+// Returns the length of the text (it's also null terminated) or 0 if buf is too small.
+size_t bas_disassemble(const char *name, int offset, const uint16_t *code, size_t count, char *buf, size_t cap);
+
+// Only checks whether a program assembles, without building the image. Unlike bas_assemble, it doesn't
+// stop at the first error. Returns the number of errors; *errors is set to the list, sorted by line and
+// then by start, which is owned by the context and valid until its next bas_assemble or bas_check call.
+size_t bas_check(bas_ctx *ctx, const char *src, size_t len, const bas_error **errors);
+
+// Writes the message of an error in the program src (as passed to bas_assemble or bas_check) to buf.
+// Returns its length like snprintf.
+int bas_format_error(const bas_error *err, const char *src, char *buf, size_t cap);
+
+// Checks that data (len bytes, aligned to 8 like mapped files and malloc-ed buffers are) is a bundle
+// whose offsets all stay inside it, so the calls below don't need to check anything. The views point
+// straight into data, so this fails on big endian hosts. Returns 1 if it's usable and 0 if not.
+int bas_bundle_open(bas_bundle *bundle, const void *data, size_t len);
+
+// The i-th program (i < bundle->count), in index order
+void bas_bundle_get(const bas_bundle *bundle, size_t i, bas_bundle_bot *bot);
+
+// Looks a program up by name (a binary search of the index). Returns 1 if found and 0 if not.
+int bas_bundle_find(const bas_bundle *bundle, const char *name, bas_bundle_bot *bot);
+
+// The hash the index is sorted by (32 bit FNV-1a of the name)
+uint32_t bas_bundle_hash(const char *name);
+
+// Name of the variable bound to the register after the last bas_assemble call (not null terminated).
+// Returns its length or 0 if the register isn't bound to a variable.
+size_t bas_variable(const bas_ctx *ctx, int reg, const char **name);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,70 @@
+#!/usr/bin/env bash
+# Compile-time benchmark of the output formats: generates bots (1000 with 500 instructions each by
+# default), assembles them as C arrays, as string literals and as object files, and times building
+# a program that uses all of them.
+#
+# bench/compile_bots.sh [bots] [instructions]   (CC and CFLAGS are honoured, CFLAGS defaults to -O2)
+set -euo pipefail
+cd "$(dirname "$0")/.."
+
+bots=${1:-1000}
+size=${2:-500}
+cc=${CC:-cc}
+cflags=${CFLAGS:--O2}
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+$cc -O2 assembler.c -o "$dir/assembler"
+mkdir "$dir/src"
+awk -v bots="$bots" -v size="$size" -v dir="$dir/src" 'BEGIN {
+	srand(1)
+	for (b = 0; b < bots; b++) {
+		f = sprintf("%s/bot%d.asm", dir, b)
+		printf "bot%d 0\n", b > f
+		for (i = 0; i < size; i++) {
+			r = int(rand() * 4)
+			if (r == 0)
+				printf "ldi %d ;load\n", int(rand() * 65536) > f
+			else if (r == 1)
+				printf "addi r%d, %d\n", 1 + int(rand() * 29), int(rand() * 64) > f
+			else if (r == 2)
+				printf "mv r%d, r%d ;move\n", 1 + int(rand() * 29), int(rand() * 32) > f
+			else
+				printf "st r%d, r%d\n", 1 + int(rand() * 29), 1 + int(rand() * 29) > f
+		}
+		close(f)
+	}
+}'
+
+# main.c touches every bot, so none of them can be dropped
+main() {
+	echo "#include <stdint.h>"
+	for ((b = 0; b < bots; b++)); do
+		if [ "$1" = elf ]; then
+			echo "extern const uint16_t bot${b}_mem[], bot${b}_size, bot${b}_offset;"
+		else
+			echo "#include \"bot$b.c\""
+		fi
+	done
+	echo "int main(void) {"
+	echo "	unsigned sum = 0;"
+	for ((b = 0; b < bots; b++)); do
+		echo "	sum += bot${b}_mem[bot${b}_size - 1] + bot${b}_offset;"
+	done
+	echo "	return sum == 42;"
+	echo "}"
+}
+
+TIMEFORMAT="%R s"
+for format in c cstring elf; do
+	mkdir "$dir/$format"
+	cp "$dir"/src/*.asm "$dir/$format"
+	"$dir/assembler" -format=$format "$dir/$format" >/dev/null
+	main $format >"$dir/$format/main.c"
+	printf "%-8s " "$format"
+	if [ $format = elf ]; then
+		time $cc $cflags -w "$dir/$format/main.c" "$dir/$format"/*.o -o "$dir/$format/main"
+	else
+		time $cc $cflags -w "$dir/$format/main.c" -o "$dir/$format/main"
+	fi
+done
@@ -0,0 +1,125 @@
+/*
+Microbenchmark of the mnemonic lookup against the strcasecmp chain it replaced. It includes the
+assembler itself, so the static getOperation is benchmarked as is:
+
+cc -O2 -Wall bench/getop.c -o getop && ./getop [iterations]
+
+Both lookups are also run on every mnemonic first and have to agree on the opcode and on whether
+it's valid.
+*/
+
+#define BAS_NO_MAIN
+#include "../assembler.c"
+
+// getOperation before the switch on packed bytes (the token was a null terminated string then)
+static int getOperationChain(bas_ctx *ctx, const Token *tok, fint *ret) {
+	const char *symbol = tok->s;
+	if (strcasecmp(symbol, "ldi") == 0) {
+		*ret = OP_LDI;
+	} else if (strcasecmp(symbol, "mv") == 0) {
+		*ret = OP_MV;
+	} else if (strcasecmp(symbol, "add") == 0) {
+		*ret = OP_ADD;
+	} else if (strcasecmp(symbol, "sub") == 0) {
+		*ret = OP_SUB;
+	} else if (strcasecmp(symbol, "not") == 0) {
+		*ret = OP_NOT;
+	} else if (strcasecmp(symbol, "and") == 0) {
+		*ret = OP_AND;
+	} else if (strcasecmp(symbol, "or") == 0) {
+		*ret = OP_OR;
+	} else if (strcasecmp(symbol, "xor") == 0) {
+		*ret = OP_XOR;
+	} else if (strcasecmp(symbol, "shl") == 0) {
+		*ret = OP_SHL;
+	} else if (strcasecmp(symbol, "shr") == 0) {
+		*ret = OP_SHR;
+	} else if (strcasecmp(symbol, "jmp") == 0) {
+		*ret = OP_JMP;
+	} else if (strcasecmp(symbol, "jz") == 0) {
+		*ret = OP_JZ;
+	} else if (strcasecmp(symbol, "jnz") == 0) {
+		*ret = OP_JNZ;
+	} else if (strcasecmp(symbol, "jn") == 0) {
+		*ret = OP_JN;
+	} else if (strcasecmp(symbol, "jp") == 0) {
+		*ret = OP_JP;
+	} else if (strcasecmp(symbol, "ld") == 0) {
+		*ret = OP_LD;
+	} else if (strcasecmp(symbol, "st") == 0) {
+		*ret = OP_ST;
+	} else if (strcasecmp(symbol, "push") == 0) {
+		*ret = OP_PUSH;
+	} else if (strcasecmp(symbol, "pop") == 0) {
+		*ret = OP_POP;
+	} else if (strcasecmp(symbol, "addi") == 0) {
+		*ret = OP_ADDI;
+	} else if (strcasecmp(symbol, "subi") == 0) {
+		*ret = OP_SUBI;
+	} else if (strcasecmp(symbol, "shli") == 0) {
+		*ret = OP_SHLI;
+	} else if (strcasecmp(symbol, "shri") == 0) {
+		*ret = OP_SHRI;
+	} else if (strcasecmp(symbol, "flag") == 0) {
+		*ret = OP_FLAG;
+	} else {
+		return setError(ctx, BAS_E_UNKNOWN_INSTRUCTION, tok->s, tok->len, 0, 0);
+	}
+	return 1;
+}
+
+// Roughly what bots are made of: mostly ldi, mv and jumps, some arithmetic, in either case, and the
+// odd typo
+static const char *mnemonics[] = {
+	"ldi", "ldi", "ldi", "LDI", "mv", "mv", "mv", "MV", "jmp", "jz", "jnz", "jn", "jp", "add", "sub", "addi",
+	"subi", "shli", "shri", "st", "ld", "push", "pop", "and", "xor", "flag", "Flag", "mov", "jump",
+};
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int main(int argc, char *argv[]) {
+	long iterations = argc > 1 ? atol(argv[1]) : 2000000;
+	size_t count = sizeof(mnemonics) / sizeof(*mnemonics);
+	Token *tokens = malloc(count * sizeof(*tokens));
+	bas_ctx *ctx = bas_new(NULL);
+	if (!tokens || !ctx) {
+		perror("getop");
+		return 1;
+	}
+	for (size_t i = 0; i < count; i++) { // folded like compileLine gets them
+		const char *p = mnemonics[i];
+		nextToken(&p, p + strlen(p), &tokens[i]);
+	}
+
+	for (size_t i = 0; i < count; i++) {
+		fint a = 0, b = 0;
+		int ok_a = getOperation(ctx, &tokens[i], &a), ok_b = getOperationChain(ctx, &tokens[i], &b);
+		if (ok_a != ok_b || (ok_a && a != b)) {
+			fprintf(stderr, "Mismatch on '%s': %d (%d) vs %d (%d)\n", mnemonics[i], a, ok_a, b, ok_b);
+			return 1;
+		}
+	}
+
+	int (*lookups[])(bas_ctx *, const Token *, fint *) = {getOperationChain, getOperation};
+	const char *names[] = {"chain", "switch"};
+	for (int l = 0; l < 2; l++) {
+		volatile int sink = 0;
+		double start = now();
+		for (long it = 0; it < iterations; it++) {
+			for (size_t i = 0; i < count; i++) {
+				fint op = 0;
+				sink += lookups[l](ctx, &tokens[i], &op) + op;
+			}
+		}
+		double ns = (now() - start) / ((double)iterations * count);
+		printf("%-8s %6.2f ns/lookup\n", names[l], ns);
+	}
+
+	bas_free(ctx);
+	free(tokens);
+	return 0;
+}
@@ -0,0 +1,104 @@
+/*
+Microbenchmark of the literal parser against the strtol based one it replaced. It includes the
+assembler itself, so the static parseNum is benchmarked as is:
+
+cc -O2 -Wall bench/parsenum.c -o parsenum && ./parsenum [iterations]
+
+Both parsers are also run on every literal first and have to agree on the value and on whether it's valid.
+*/
+
+#define BAS_NO_MAIN
+#include "../assembler.c"
+
+// parseNum before the chunked parser
+static int parseNumStrtol(bas_ctx *ctx, const Token *tok, int *ret) {
+	const char *s = tok->s;
+	int n = tok->len;
+	char buf[64], *endptr;
+
+	errno = 0;
+
+	if (s[0] == '0' && n > 1 && s[1] == 'b') {
+		long val = 0;
+		for (int i = 2; i < n; i++) {
+			if (s[i] == '0' || s[i] == '1') {
+				val = val * 2 + (s[i] - '0');
+			} else if (s[i] != '.') {
+				return setError(ctx, BAS_E_BINARY, s, n, 0, 0);
+			}
+		}
+		*ret = val;
+		return 1;
+	} else if (s[0] == '0' && n > 1 && s[1] == 'x') {
+		snprintf(buf, sizeof(buf), "%.*s", n - 2, s + 2);
+		long val = strtol(buf, &endptr, 16);
+		if (*endptr != '\0' || n == 2 || n - 2 >= (int)sizeof(buf) || errno != 0) {
+			return setError(ctx, BAS_E_HEX, s, n, 0, 0);
+		}
+		*ret = val;
+		return 1;
+	} else {
+		snprintf(buf, sizeof(buf), "%.*s", n, s);
+		long val = strtol(buf, &endptr, 10);
+		if (*endptr != '\0' || n >= (int)sizeof(buf) || errno != 0) {
+			return setError(ctx, BAS_E_DECIMAL, s, n, 0, 0);
+		}
+		*ret = val;
+		return 1;
+	}
+}
+
+// Roughly what bots are made of: ldi payloads, shift amounts, addresses, and the constants that
+// fail parseNum before parseConst takes them
+static const char *literals[] = {
+	"0b101001.11100.0000", "0b100000.00001.00000", "0b1101000001000001", "0b110100.00001.000001", "1", "5",
+	"12", "31", "63", "1023", "65535", "0x3f", "0xFC00", "0x1", "0xbeef", "-3", "+10", "#size", "#before:-2",
+	"#after:+1:2", "0b12", "0xg", "12a",
+};
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int main(int argc, char *argv[]) {
+	long iterations = argc > 1 ? atol(argv[1]) : 2000000;
+	size_t count = sizeof(literals) / sizeof(*literals);
+	Token *tokens = malloc(count * sizeof(*tokens));
+	bas_ctx *ctx = bas_new(NULL);
+	if (!tokens || !ctx) {
+		perror("parsenum");
+		return 1;
+	}
+	for (size_t i = 0; i < count; i++)
+		tokens[i] = (Token){.s = literals[i], .len = (int)strlen(literals[i])};
+
+	for (size_t i = 0; i < count; i++) {
+		int a = 0, b = 0;
+		int ok_a = parseNum(ctx, &tokens[i], &a), ok_b = parseNumStrtol(ctx, &tokens[i], &b);
+		if (ok_a != ok_b || (ok_a && a != b)) {
+			fprintf(stderr, "Mismatch on '%s': %d (%d) vs %d (%d)\n", literals[i], a, ok_a, b, ok_b);
+			return 1;
+		}
+	}
+
+	int (*parsers[])(bas_ctx *, const Token *, int *) = {parseNumStrtol, parseNum};
+	const char *names[] = {"strtol", "chunked"};
+	for (int p = 0; p < 2; p++) {
+		volatile int sink = 0;
+		double start = now();
+		for (long it = 0; it < iterations; it++) {
+			for (size_t i = 0; i < count; i++) {
+				int val = 0;
+				sink += parsers[p](ctx, &tokens[i], &val) + val;
+			}
+		}
+		double ns = (now() - start) / ((double)iterations * count);
+		printf("%-8s %6.2f ns/literal\n", names[p], ns);
+	}
+
+	bas_free(ctx);
+	free(tokens);
+	return 0;
+}
@@ -0,0 +1,89 @@
+#!/usr/bin/env bash
+# Throughput of the line tokenizer: generates a large synthetic program (1M lines by default: a mix
+# of instructions, number formats, variables, comments and blank lines) and reports lines/s of a
+# baseline assembler and of the current one, with -nocomments and -obfuscate so output formatting
+# stays small. Best of 5 runs each. The baseline is a git revision (e.g. the one before in-place
+# tokenizing) or the path of an assembler.c. Given a revision, that one is measured instead of the
+# working tree.
+#
+# bench/tokenize.sh <baseline revision or assembler.c> [lines] [revision]   (CC is honoured)
+set -euo pipefail
+cd "$(dirname "$0")/.."
+
+if [ $# -lt 1 ]; then
+	echo "usage: $0 <baseline revision or assembler.c> [lines] [revision]" >&2
+	exit 2
+fi
+base=$1
+lines=${2:-1000000}
+rev=${3:-}
+cc=${CC:-cc}
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+# build <revision, assembler.c or empty for the working tree> <output>
+build() {
+	local src=${1:-assembler.c}
+	mkdir "$dir/$2.src"
+	if [ -f "$src" ]; then
+		cp "$src" "$dir/$2.src/assembler.c"
+		[ ! -f "$(dirname "$src")/battelasm.h" ] || cp "$(dirname "$src")/battelasm.h" "$dir/$2.src/"
+	else
+		git show "$src:assembler.c" >"$dir/$2.src/assembler.c"
+		git show "$src:battelasm.h" >"$dir/$2.src/battelasm.h" 2>/dev/null || true # older trees had no header
+	fi
+	$cc -O2 "$dir/$2.src/assembler.c" -o "$dir/$2"
+}
+build "$rev" current
+build "$base" base
+
+awk -v lines="$lines" 'BEGIN {
+	srand(1)
+	print "big 0"
+	for (i = 1; i < lines; i++) {
+		r = int(rand() * 10)
+		if (r == 0)
+			print "ldi " int(rand() * 65536) " ;load a constant"
+		else if (r == 1)
+			printf "ldi 0x%x\n", int(rand() * 65536)
+		else if (r == 2)
+			print "ldi 0b1010.0101"
+		else if (r == 3)
+			print "addi r" 1 + int(rand() * 29) ", " int(rand() * 64)
+		else if (r == 4)
+			print "  add r" 1 + int(rand() * 29) ", r" 1 + int(rand() * 29)
+		else if (r == 5)
+			print "mv [counter], pc"
+		else if (r == 6)
+			print "subi [counter], 1 ;step"
+		else if (r == 7)
+			print "; a comment line"
+		else if (r == 8)
+			print ""
+		else
+			print "st r" 1 + int(rand() * 29) ", r" 1 + int(rand() * 29)
+	}
+}' >"$dir/big.asm"
+
+if ! cmp -s <("$dir/base" -nocomments "$dir/big.asm") <("$dir/current" -nocomments "$dir/big.asm"); then
+	echo "the outputs differ" >&2
+	exit 1
+fi
+
+best() { # best time of 5 runs in seconds
+	local t min=
+	for _ in 1 2 3 4 5; do
+		local start=$(date +%s%N)
+		"$@" >/dev/null
+		t=$(($(date +%s%N) - start))
+		if [ -z "$min" ] || [ "$t" -lt "$min" ]; then min=$t; fi
+	done
+	echo "$min"
+}
+
+for flag in -nocomments -obfuscate; do
+	b=$(best "$dir/base" $flag "$dir/big.asm")
+	c=$(best "$dir/current" $flag "$dir/big.asm")
+	awk -v f="$flag" -v l="$lines" -v b="$b" -v c="$c" \
+		'BEGIN { printf "%-12s %.2f -> %.2f M lines/s\n", f, l / b * 1000, l / c * 1000 }'
+done
@@ -0,0 +1,60 @@
+/*
+Reads a bundle through the library, like a simulator would: prints every bot in index order and then
+looks up each name given after the file. tests/run.sh builds it against assembler.c:
+
+cc -DBAS_NO_MAIN tests/bundle.c assembler.c -o bundle && ./bundle bots.basb [names...]
+
+A bot is printed as "name size offset word..." (words in hex), a missing one as "name missing".
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../battelasm.h"
+
+static void printBot(const bas_bundle_bot *bot) {
+	printf("%s %zu %d", bot->name, bot->size, bot->offset);
+	for (size_t i = 0; i < bot->size; i++)
+		printf(" %04x", bot->code[i]);
+	printf("\n");
+}
+
+int main(int argc, char **argv) {
+	if (argc < 2) {
+		fprintf(stderr, "Usage: %s <bots.basb> [names...]\n", argv[0]);
+		return 2;
+	}
+	FILE *f = fopen(argv[1], "rb");
+	if (!f) {
+		perror(argv[1]);
+		return 1;
+	}
+	fseek(f, 0, SEEK_END);
+	long len = ftell(f);
+	rewind(f);
+	void *data = malloc(len ? len : 1); // aligned like the library wants
+	if (!data || fread(data, 1, len, f) != (size_t)len) {
+		perror(argv[1]);
+		return 1;
+	}
+	fclose(f);
+
+	bas_bundle bundle;
+	bas_bundle_bot bot;
+	if (!bas_bundle_open(&bundle, data, len)) {
+		fprintf(stderr, "%s: not a bundle\n", argv[1]);
+		return 1;
+	}
+	for (size_t i = 0; i < bundle.count; i++) {
+		bas_bundle_get(&bundle, i, &bot);
+		printBot(&bot);
+	}
+	for (int i = 2; i < argc; i++) {
+		if (bas_bundle_find(&bundle, argv[i], &bot))
+			printBot(&bot);
+		else
+			printf("%s missing\n", argv[i]);
+	}
+	free(data);
+	return 0;
+}
@@ -0,0 +1,202 @@
+#!/usr/bin/env bash
+# Regression tests of the command line: builds the assembler and checks the output (or the error) of
+# small programs. Bundles are read back with tests/bundle.c, which uses the library like a simulator
+# would. Exits nonzero if any check failed.
+#
+# tests/run.sh   (CC is honoured)
+set -uo pipefail
+cd "$(dirname "$0")/.."
+
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+${CC:-cc} -O2 -Wall assembler.c -o "$dir/assembler" || exit 1
+${CC:-cc} -O2 -Wall -DBAS_NO_MAIN tests/bundle.c assembler.c -o "$dir/bundle" || exit 1
+asm="$dir/assembler"
+failed=0
+
+# check <name> <command...>: the command must succeed
+check() {
+	local name=$1
+	shift
+	if ! "$@" >"$dir/out" 2>&1; then
+		echo "FAIL $name"
+		cat "$dir/out"
+		failed=1
+	fi
+}
+
+# fails <name> <command...>: the command must fail
+fails() {
+	local name=$1
+	shift
+	if "$@" >"$dir/out" 2>&1; then
+		echo "FAIL $name (succeeded)"
+		failed=1
+	fi
+}
+
+# A directive moved off column 0 is an error, even if the same program at column 0 is cached
+mkdir "$dir/cache"
+printf 'c 0\nldi 1\n#starts 3\nldi 2\n' >"$dir/col0.asm"
+printf 'c 0\nldi 1\n  #starts 3\nldi 2\n' >"$dir/indented.asm"
+check "cache: column 0 directive" "$asm" -nocomments -cache "$dir/cache" "$dir/col0.asm"
+fails "cache: indented directive" "$asm" -nocomments -cache "$dir/cache" "$dir/indented.asm"
+check "cache: column 0 directive (-obfuscate)" "$asm" -obfuscate -cache "$dir/cache" "$dir/col0.asm"
+fails "cache: indented directive (-obfuscate)" "$asm" -obfuscate -cache "$dir/cache" "$dir/indented.asm"
+
+# Empty arguments of a compile-time constant keep their default (change 0, multiplier 1)
+printf 'c 0\nldi #size::2\nldi #after:1:\nldi #size:\nldi #before::3\n' >"$dir/const.asm"
+check "const: empty arguments" "$asm" -nocomments -decimal "$dir/const.asm"
+if [ "$(tr -d ' \t\n' <"$dir/out")" != "staticuint16_tc_mem[]={8,3,4,9,};staticuint16_tc_size=4;staticuint16_tc_offset=0;" ]; then
+	echo "FAIL const: values"
+	cat "$dir/out"
+	failed=1
+fi
+
+# Every C layout disassembles to the same source as the binary image (bytes that need escapes included)
+printf 'c 7\nldi 0x7d22\nldi 0x5c3f\naddi r1, 5\nmv r2, pc\nldi 0xffff\n' >"$dir/layout.asm"
+"$asm" -format=bin -o "$dir/layout.bin" "$dir/layout.asm" && "$asm" -disasm "$dir/layout.bin" >"$dir/layout.ref"
+for flags in "-format=c" "-format=c -const" "-format=cstring" "-format=cstring -const" "-format=cstring -obfuscate"; do
+	"$asm" $flags -o "$dir/layout.c" "$dir/layout.asm"
+	check "disasm: $flags" "$asm" -disasm "$dir/layout.c"
+	cp "$dir/out" "$dir/layout.got"
+	check "disasm: $flags matches" cmp "$dir/layout.ref" "$dir/layout.got"
+done
+
+# A number too big for an int is out of range, not malformed
+for num in 65536 99999999999 0x80000000 0b11111111111111111111111111111111111111111 -99999999999; do
+	printf 'c 0\nldi %s\n' "$num" >"$dir/big.asm"
+	fails "range: $num" "$asm" "$dir/big.asm"
+	if ! grep -q "Number not in range \[0, 2^16): '$num'" "$dir/out"; then
+		echo "FAIL range: $num message"
+		cat "$dir/out"
+		failed=1
+	fi
+done
+printf 'c 0\nldi 0x8000000g\n' >"$dir/big.asm"
+fails "range: bad digit" "$asm" "$dir/big.asm"
+if ! grep -q "Invalid hexadecimal number" "$dir/out"; then
+	echo "FAIL range: bad digit message"
+	cat "$dir/out"
+	failed=1
+fi
+
+# The immediate shares bit 5 with the register, so an odd register shows up in it
+printf 'c 0\nsubi r1, 2\naddi r2, 5\n' >"$dir/imm.asm"
+check "disasm: assemble" "$asm" -format=bin -o "$dir/imm.bin" "$dir/imm.asm"
+check "disasm: odd register" "$asm" -disasm "$dir/imm.bin"
+if ! grep -qx 'subi r1, 34' "$dir/out" || ! grep -qx 'addi r2, 5' "$dir/out"; then
+	echo "FAIL disasm: immediates"
+	cat "$dir/out"
+	failed=1
+fi
+"$asm" -disasm "$dir/imm.bin" >"$dir/imm2.asm" && "$asm" -format=bin -o "$dir/imm2.bin" "$dir/imm2.asm"
+check "disasm: round trip" cmp "$dir/imm.bin" "$dir/imm2.bin"
+
+check "decoded: odd register" "$asm" -nocomments -decoded "$dir/imm.asm"
+if ! grep -qF '{0x33, BOT_SUBI, 1, 0, 34},' "$dir/out" || ! grep -qF '{0x32, BOT_ADDI, 2, 0, 5},' "$dir/out"; then
+	echo "FAIL decoded: immediates"
+	cat "$dir/out"
+	failed=1
+fi
+
+# A second build is a hit with the same output, unless something that matters changed
+mkdir "$dir/hits"
+printf 'h 0\nldi 1\nadd r1, r2\n' >"$dir/hit.asm"
+"$asm" -nocomments -cache "$dir/hits" -cachestats "$dir/hit.asm" >"$dir/hit.first" 2>"$dir/hit.stats"
+"$asm" -nocomments -cache "$dir/hits" -cachestats "$dir/hit.asm" >"$dir/hit.second" 2>>"$dir/hit.stats"
+printf 'h 0\nldi   1 ; no change\nadd r1,r2\n' >"$dir/hit.asm"
+"$asm" -nocomments -cache "$dir/hits" -cachestats "$dir/hit.asm" >/dev/null 2>>"$dir/hit.stats"
+printf 'h 0\nldi 2\nadd r1, r2\n' >"$dir/hit.asm"
+"$asm" -nocomments -cache "$dir/hits" -cachestats "$dir/hit.asm" >/dev/null 2>>"$dir/hit.stats"
+if [ "$(cut -d, -f1-3 "$dir/hit.stats" | tr '\n' '|')" != "cache: 0 hits, 1 misses, 1 stored|cache: 1 hits, 0 misses, 0 stored|cache: 1 hits, 0 misses, 0 stored|cache: 0 hits, 1 misses, 1 stored|" ]; then
+	echo "FAIL cache: hits and misses"
+	cat "$dir/hit.stats"
+	failed=1
+fi
+check "cache: hit has the same output" cmp "$dir/hit.first" "$dir/hit.second"
+
+# A program with a random offset is never cached, however long its name
+printf '%s -1\nldi 1\n' "$(printf 'b%.0s' {1..70})" >"$dir/random.asm"
+check "cache: random offset" "$asm" -nocomments -cache "$dir/cache" "$dir/random.asm"
+check "cache: random offset again" "$asm" -nocomments -cache "$dir/cache" -cachestats "$dir/random.asm"
+if ! grep -q '0 hits, 1 misses, 0 stored' "$dir/out"; then
+	echo "FAIL cache: random offset stored"
+	cat "$dir/out"
+	failed=1
+fi
+
+# Server responses: status, size, offset, flags, error code, line, start, len, text length
+{ printf '\x0b\0\0\0c -1\nldi 1\n'; printf '\x0e\0\0\0c 0\nldi 65536\n'; } >"$dir/requests"
+check "server" "$asm" -server <"$dir/requests"
+cp "$dir/out" "$dir/responses"
+read -ra ok_frame < <(od -An -tu4 -v -N36 "$dir/responses" | tr -s ' \n' ' ')
+read -ra err_frame < <(od -An -tu4 -v -j39 -N36 "$dir/responses" | tr -s ' \n' ' ') # after 1 byte of name and 1 word
+if [ "${ok_frame[*]:0:2} ${ok_frame[*]:3}" != "0 1 1 0 0 0 0 1" ] || [ "${err_frame[*]:0:8}" != "1 0 0 0 5 2 8 5" ]; then
+	echo "FAIL server: frames ${ok_frame[*]} / ${err_frame[*]}"
+	failed=1
+fi
+
+# -check lists errors in source order, though fixups and the random offset are checked last
+printf 'c -1\nldi #size:70000\nfoo r1\n#starts 1100\nldi 99999\n' >"$dir/errors.asm"
+fails "check: errors" "$asm" -check "$dir/errors.asm"
+if [ "$(sed 's/^Error on line \([0-9]*\).*/\1/' "$dir/out" | tr '\n' ' ')" != "1 2 3 5 " ]; then
+	echo "FAIL check: error order"
+	cat "$dir/out"
+	failed=1
+fi
+
+# -watch has a single output
+printf 'c 0\nldi 1\n' >"$dir/w.asm"
+for flag in -bundle -registry; do
+	fails "watch: $flag" timeout 5 "$asm" $flag "$dir/w.out" -watch "$dir/w.asm" # the old code watched forever
+	if ! grep -q "doesn't take -registry or -bundle" "$dir/out"; then
+		echo "FAIL watch: $flag message"
+		cat "$dir/out"
+		failed=1
+	fi
+done
+
+# A bundle is read back through the library, in index order and by name
+mkdir "$dir/bots"
+printf 'mars 5\nldi 1\naddi r1, 5\n' >"$dir/bots/mars.asm"
+printf 'venus 0\nmv r2, pc\n' >"$dir/bots/venus.asm"
+printf 'zed 0\n#starts 2\nldi 0xbeef\n' >"$dir/bots/zed.asm"
+check "bundle: write" "$asm" -bundle "$dir/bots.basb" "$dir/bots"
+check "bundle: read" "$dir/bundle" "$dir/bots.basb" zed mars pluto
+sort "$dir/out" >"$dir/bundle.got"
+printf '%s\n' "mars 2 5 0001 c825" "mars 2 5 0001 c825" "pluto missing" "venus 1 0 805f" "zed 3 0 fc00 fc00 beef" "zed 3 0 fc00 fc00 beef" >"$dir/bundle.want"
+check "bundle: bots" cmp "$dir/bundle.want" "$dir/bundle.got"
+
+# Source map: header, an entry per instruction (padding has line 0), the path and the variables
+printf 'c 0\nldi 1\n  addi x, 5 ; comment\n#starts 3\n' >"$dir/m.asm"
+(cd "$dir" && "$asm" -map m.asm >/dev/null)
+want="42 4d 41 50 01 00 05 00 03 00 00 00 01 00 00 00" # BMAP, version 1, path of 5, 3 instructions, 1 variable
+want+=" 02 00 00 00 01 00 05 00 03 00 00 00 03 00 09 00 00 00 00 00 00 00 00 00" # ldi 1, addi x, 5, padding
+want+=" 6d 2e 61 73 6d 01 00 01 00 78" # m.asm, x in r1
+if [ "$(od -An -tx1 -v "$dir/m.map" | tr -s ' \n' ' ' | sed 's/^ //; s/ $//')" != "$want" ]; then
+	echo "FAIL map: layout"
+	od -An -tx1 -v "$dir/m.map"
+	failed=1
+fi
+
+# -o replaces a file, writes through a symbolic link and leaves devices alone
+printf 'c 0\nldi 1\n' >"$dir/o.asm"
+echo old >"$dir/o.c"
+check "-o: existing file" "$asm" -o "$dir/o.c" "$dir/o.asm"
+check "-o: existing file replaced" grep -q c_mem "$dir/o.c"
+echo old >"$dir/real.c"
+ln -s real.c "$dir/link.c"
+check "-o: symlink" "$asm" -o "$dir/link.c" "$dir/o.asm"
+check "-o: symlink kept" test -L "$dir/link.c"
+check "-o: symlink target written" grep -q c_mem "$dir/real.c"
+mkfifo "$dir/fifo"
+timeout 10 cat "$dir/fifo" >"$dir/fifo.out" & # a FIFO replaced by a file would never be written
+check "-o: FIFO" timeout 10 "$asm" -o "$dir/fifo" "$dir/o.asm"
+wait
+check "-o: FIFO kept" test -p "$dir/fifo"
+check "-o: FIFO written" grep -q c_mem "$dir/fifo.out"
+check "-o: no temporary files left" test -z "$(find "$dir" -name '*.c.??????')"
+
+[ $failed = 0 ] && echo "all tests passed"
+exit $failed